@@ -1,16 +1,94 @@
 #include "main.h"
 
+/* Descriptor of one cell generated from the pack's tap pairs: 16 samples, 14 bits */
+#define PACK_CELL_DESCRIPTOR(n, pos, neg, mode)	{pos, neg, mode, CELL_SAMPNUM, 32, 0, 0x01},
+/* Descriptor of the tap at the top of a cell against ground, for the tap-voltage solver */
+#define PACK_TAP_DESCRIPTOR(n, pos, neg, mode)	{pos, GND_ADC_CHANNEL, 0x00, CELL_SAMPNUM, 32, 0, 0x01},
+
+/* Channel descriptor table walked by the scan sequencer, indexed by ADC_CHANNEL_ID.
+   Accumulation trades conversion time for resolution: every 4x more samples adds 1 effective bit */
+adc_channel_descriptor adc_channel_table[ADC_CHANNEL_COUNT] = {
+	/* MUXPOS,			MUXNEG,				mode, accumulation,			settle timeout, sample length, auto-range */
+	PACK_CELLS(PACK_CELL_DESCRIPTOR)																// ADC_CH_B1 ... ADC_CH_Bn: cell taps, 14 bits
+	{OPAMP_ADC_CHANNEL,	GND_ADC_CHANNEL,	0x00, ADC_SAMPNUM_ACC4_gc,	4, 0, 0x01},		// ADC_CH_LOAD_CURRENT: OP2 output, 13 bits, polled often
+	{PACK_TOP_ADC_CHANNEL,	GND_ADC_CHANNEL,	0x00, ADC_SAMPNUM_NONE_gc,	32, 0, 0x00},	// ADC_CH_PACK: top tap - GND, 12 bits, connection check only
+	{DAC0_ADC_CHANNEL,	GND_ADC_CHANNEL,	0x00, ADC_SAMPNUM_NONE_gc,	32, 0, 0x00},		// ADC_CH_DAC_LOOPBACK: DAC0 - GND, set by the self-test
+	{TEMPSENSE_ADC_CHANNEL,	GND_ADC_CHANNEL,	0x00, ADC_SAMPNUM_ACC4_gc,	32, TEMPSENSE_SAMPLEN, 0x00},	// ADC_CH_TEMPERATURE: internal sensor, needs >= 32us sampling
+	PACK_CELLS(PACK_TAP_DESCRIPTOR)																// ADC_CH_T1 ... ADC_CH_Tn: taps single-ended, 14 bits
+};
+
+/* Reference auto-ranging: references usable at the supply voltage, smallest first, VDD last.
+   Filled in by ADC_reference_init(), every channel starts on VDD */
+adc_reference adc_reference_table[ADC_REFERENCES];
+uint8_t adc_reference_count;
+static uint8_t adc_channel_reference[ADC_CHANNEL_COUNT];	// reference table index the next scan of a channel uses
+static volatile uint8_t adc_reference_active;				// reference table index ADC0 is set to
+
+/* Settling: consecutive single conversions must agree within this many 12-bit LSBs */
+uint8_t adc_settle_tolerance = 2;
+adc_settle_stats adc_settle_statistics[ADC_CHANNEL_COUNT];
+
+/* Scan orders used by the measurement functions */
+const uint8_t adc_scan_cells[PACK_CELL_COUNT] = {PACK_CELLS(PACK_CELL_CHANNEL_ID)};
+const uint8_t adc_scan_taps[PACK_CELL_COUNT] = {PACK_CELLS(PACK_TAP_CHANNEL_ID)};
+
+/* Loaded snapshot: current, cells forward, current, cells backward, current. Every cell is
+   sampled symmetrically around the middle current sample, which is the snapshot instant */
+const uint8_t adc_scan_snapshot[LOADED_SNAPSHOT_LENGTH] = {
+	ADC_CH_LOAD_CURRENT, PACK_CELLS(PACK_CELL_CHANNEL_ID)
+	ADC_CH_LOAD_CURRENT, PACK_CELLS_REVERSED(PACK_CELL_CHANNEL_ID)
+	ADC_CH_LOAD_CURRENT
+};
+const uint8_t adc_scan_load_current[1] = {ADC_CH_LOAD_CURRENT};
+const uint8_t adc_scan_pack[1] = {ADC_CH_PACK};
+const uint8_t adc_scan_dac_loopback[1] = {ADC_CH_DAC_LOOPBACK};
+
+/* Scan sequencer state, shared between the RESRDY ISR and the consumers */
+static const uint8_t *adc_scan_sequence;	// channel IDs to convert, in order
+static volatile uint8_t adc_scan_length;	// number of entries in the sequence
+static volatile uint8_t adc_scan_index;		// sequence entry currently being converted
+static volatile uint8_t adc_scan_settling;	// 0x01 while the input of the current channel settles
+static volatile uint8_t adc_scan_settle_count;	// settling conversions done on the current channel
+static volatile int16_t adc_scan_settle_last;	// previous settling conversion result
+static volatile uint8_t adc_scan_busy;		// 0x01 while a scan is in progress
+static volatile uint16_t adc_scan_start_time;	// timestamp of the start of the conversion that is kept
+static volatile uint8_t adc_scan_settle_min;	// settling conversions required after a reference change
+static volatile uint8_t adc_scan_sampnum;		// accumulation of the conversion that is kept
+
+/* Hardware-timed sampling state, shared between the RESRDY ISR and the consumers */
+static volatile uint8_t adc_clocked;			// 0x01 while the sample clock triggers conversions
+static const uint8_t *adc_clocked_sequence;	// channel IDs converted round robin, one per sample clock event
+static volatile uint8_t adc_clocked_length;		// number of entries in the sequence
+static volatile uint8_t adc_clocked_index;		// sequence entry the next event converts
+static volatile uint8_t adc_clocked_channel;	// channel ID the next event converts
+static volatile uint16_t adc_clocked_last_sequence;	// sequence number of the previous result
+
+/* Window comparator monitor state, shared between the WCMP ISR and the consumers */
+static volatile uint8_t adc_monitor_armed;		// 0x01 while a channel free-runs against a threshold
+static volatile uint8_t adc_monitor_latched;	// 0x01 once the threshold was crossed
+static volatile uint8_t adc_monitor_channel;	// channel ID being monitored
+static volatile uint16_t adc_monitor_raw;		// ADC0.RES of the conversion that crossed the threshold
+static const uint8_t *adc_monitor_capture;		// scan started on the crossing, NULL for none
+static uint8_t adc_monitor_capture_length;
+
+/* Result ring buffer, written by the RESRDY ISR and read by ADC_ring_pop() */
+static volatile adc_result adc_ring[ADC_RING_SIZE];
+static volatile uint8_t adc_ring_head;	// next slot written by the ISR
+static volatile uint8_t adc_ring_tail;	// next slot read by the consumer
+
 //***************************************************************************
 //
 // Function Name : "ADC_init"
 // Target MCU : AVR128DB48
 // DESCRIPTION
 // Initializes the ADC0 module of the AVR128DB48 for differential or
-// single-ended mode, VDD reference, 12-bit resolution, free-run mode,
-// 16 sample accumulation, and clock prescalar divided by 4.
-// Enables interrupts and ADC0 module.
+// single-ended mode, VDD reference, 12-bit resolution, single conversion
+// mode, 16 sample accumulation, and clock prescalar divided by 4.
+// Enables the result ready interrupt used by the scan sequencer and
+// enables the ADC0 module. Only needs to be called once at start-up,
+// the scan sequencer switches the mode per channel afterwards.
 //
-// Inputs : 
+// Inputs :
 //		uint8_t mode: 0 -> single ended, 1 -> differential
 //
 // Outputs : None
@@ -19,21 +97,34 @@
 void ADC_init(uint8_t mode)
 {
 	adc_mode = mode;	// single-ended or differential mode
-	
-	// Use VDD as reference
+
+	// Use VDD as reference until ADC_reference_init() lists the internal ones
 	VREF.ADC0REF = VREF_REFSEL_VDD_gc;
-	
-	// 12-bit resolution, Free-Run mode, differential/single-ended, Right adjusted, Enable
-	ADC0.CTRLA = (ADC_RESSEL_12BIT_gc | ADC_FREERUN_bm | (adc_mode << 5) | ADC_ENABLE_bm);
+	adc_reference_table[0].refsel = VREF_REFSEL_VDD_gc;
+	adc_reference_table[0].mv = adc_vref_mv;
+	adc_reference_table[0].scale = ADC_REF_SCALE_ONE;
+	adc_reference_table[0].sampnum_reduction = 0;
+	adc_reference_count = 1;
+	adc_reference_active = 0;
+	for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++)
+		adc_channel_reference[i] = 0;
+
+	// 12-bit resolution, single conversion, differential/single-ended, Right adjusted, Enable
+	ADC0.CTRLA = (ADC_RESSEL_12BIT_gc | (adc_mode << 5) | ADC_ENABLE_bm);
 
 	//enables interrupt
 	ADC0.INTCTRL |= ADC_RESRDY_bm;
 
 	// Set to accumulate 16 samples
 	ADC0.CTRLB = ADC_SAMPNUM_ACC16_gc;
-	
+
 	// Divided CLK_PER by 4
 	ADC0.CTRLC = ADC_PRESC_DIV4_gc;
+
+	/* Sequencer starts out idle with an empty ring buffer */
+	adc_scan_busy = 0x00;
+	adc_ring_head = 0;
+	adc_ring_tail = 0;
 }
 
 //***************************************************************************
@@ -100,7 +191,7 @@ uint8_t ADC_isConversionDone(void)
 // Selects 1 (single ended mode) or 2 channels (differential mode)
 //	for ADC0 to read the voltage from
 //
-// Inputs : 
+// Inputs :
 //		uint8_t AIN_POS: Positive differential or single-ended input
 //		uint8_t AIN_NEG: Negative differential input
 //
@@ -122,133 +213,1473 @@ void ADC_channelSEL(uint8_t AIN_POS, uint8_t AIN_NEG)
 }
 //***************************************************************************
 //
-// Function Name : "ADC_read"
+// Function Name : "ADC_select"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-//	Reads an integer value from the ADC and converts it to a floating point
-//	voltage based on reference voltage and conversion resolution
+//	Switches ADC0 between single-ended and differential mode and selects
+//	the inputs of one entry of the channel descriptor table, without
+//	touching the rest of CTRLA.
 //
-// Inputs : None
+// Inputs :
+//		uint8_t channel: index into adc_channel_table (ADC_CHANNEL_ID)
 //
-// Outputs : 
-//		float result: A floating point voltage converted by the ADC
+// Outputs : None
 //
 //**************************************************************************
-float ADC_read(void)
+static void ADC_select(uint8_t channel)
 {
-	/* Perform ADC conversion */
-	ADC_startConversion();
-	while(ADC_isConversionDone() != 0x01);	// wait for conversion to finish
-	ADC_stopConversion();
-	
-	/* 12 bit result was left adjusted, so shift right 4 places to fix, reading ADC.RES clears interrupt flag */
-	if (adc_mode == 0x00)		
-		return (float)( adc_vref * (ADC0.RES >> 4) / 4096);	// single-ended resolution is 12 bits -> 4096 values
+	const adc_channel_descriptor *desc = &adc_channel_table[channel];
+
+	adc_mode = desc->mode;
+	ADC0.CTRLA = (ADC0.CTRLA & ~(0x01 << 5)) | (adc_mode << 5);
+	ADC_channelSEL(desc->muxpos, desc->muxneg);
+	ADC0.SAMPCTRL = desc->samplen;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_reference_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Lists the references auto-ranging channels can use at the supply
+//	voltage adc_vref_mv: the internal 1.024V, 2.048V and 4.096V ones that
+//	stay below VDD by ADC_REF_HEADROOM_MV, and VDD itself as the widest.
+//	For each the integer factors the conversions need are precomputed:
+//	the scale from its codes to codes of VDD, the level a reading shows on
+//	the next smaller reference, and how many accumulation steps can be
+//	dropped for the same millivolt noise (4x fewer samples per halving of
+//	the reference). Every channel starts on VDD.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_reference_init(void)
+{
+	static const uint8_t internal_refsel[3] = {VREF_REFSEL_1V024_gc, VREF_REFSEL_2V048_gc, VREF_REFSEL_4V096_gc};
+	static const uint16_t internal_mv[3] = {1024, 2048, 4096};
+	uint8_t count = 0;
+
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		if (internal_mv[i] + ADC_REF_HEADROOM_MV > adc_vref_mv)
+			break;
+		adc_reference_table[count].refsel = internal_refsel[i];
+		adc_reference_table[count].mv = internal_mv[i];
+		count++;
+	}
+	adc_reference_table[count].refsel = VREF_REFSEL_VDD_gc;
+	adc_reference_table[count].mv = adc_vref_mv;
+	count++;
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		adc_reference *ref = &adc_reference_table[i];
+		uint32_t ratio_sq = ((uint32_t)adc_vref_mv * adc_vref_mv) / ((uint32_t)ref->mv * ref->mv);
+
+		ref->scale = (uint16_t)(((uint32_t)ref->mv * ADC_REF_SCALE_ONE + (adc_vref_mv >> 1)) / adc_vref_mv);
+		ref->down_q8 = (i == 0) ? 0 : (uint16_t)(((uint32_t)ref->mv << 8) / adc_reference_table[i - 1].mv);
+
+		/* Noise in mV scales with the reference, 4x the samples halve it: drop log2(ratio^2) steps */
+		ref->sampnum_reduction = 0;
+		while (ratio_sq >= 2)
+		{
+			ref->sampnum_reduction++;
+			ratio_sq >>= 1;
+		}
+	}
+
+	adc_reference_count = count;
+	adc_reference_active = count - 1;
+	VREF.ADC0REF = VREF_REFSEL_VDD_gc;
+	for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++)
+		adc_channel_reference[i] = count - 1;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_reference_select"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Switches the ADC reference if it is not already selected.
+//
+// Inputs :
+//		uint8_t ref: index into adc_reference_table
+//
+// Outputs :
+//		uint8_t changed: 0x01 if the reference was switched and has to settle
+//
+//**************************************************************************
+static uint8_t ADC_reference_select(uint8_t ref)
+{
+	if (ref == adc_reference_active)
+		return 0x00;
+	VREF.ADC0REF = adc_reference_table[ref].refsel;
+	adc_reference_active = ref;
+	return 0x01;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_reference_widest"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Selects VDD for the sample clock and the window comparator, which keep
+//	one reference for all their conversions, and waits for it to settle if
+//	it had to be switched.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void ADC_reference_widest(void)
+{
+	if (ADC_reference_select(adc_reference_count - 1))
+		_delay_us(ADC_REF_SETTLE_US);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_reference_pin"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Puts the scans of a channel that does not auto-range on one reference,
+//	at its full accumulation. The self-test characterizes every reference
+//	through the DAC loopback this way, and puts it back on VDD after.
+//
+// Inputs :
+//		uint8_t channel: index into adc_channel_table (ADC_CHANNEL_ID)
+//		uint8_t ref: index into adc_reference_table
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_reference_pin(uint8_t channel, uint8_t ref)
+{
+	if (!adc_channel_table[channel].autorange && ref < adc_reference_count)
+		adc_channel_reference[channel] = ref;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_autorange"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Picks the reference of the next scan of an auto-ranging channel from
+//	the level of its last result, in 1/256 of full scale. A result at or
+//	above ADC_RANGE_CLIP_Q8 is clipped: the next larger reference is taken
+//	and the conversion has to be repeated. Above ADC_RANGE_UP_Q8 the next
+//	scan moves up, and it moves down only when the reading would stay at
+//	or below ADC_RANGE_DOWN_Q8 on the smaller reference. The gap between
+//	the two levels is the hysteresis that keeps a steady input on one
+//	reference.
+//
+// Inputs :
+//		uint8_t channel: channel ID of the result
+//		uint16_t raw: ADC0.RES
+//		uint8_t sampnum: accumulation of the result
+//
+// Outputs :
+//		uint8_t repeat: 0x01 if the result clipped and has to be converted again
+//
+//**************************************************************************
+static uint8_t ADC_autorange(uint8_t channel, uint16_t raw, uint8_t sampnum)
+{
+	uint8_t ref = adc_channel_reference[channel];
+	uint8_t shift = (sampnum < 4) ? sampnum : 4;	// results of more than 16 samples are 16 bits
+	uint16_t level;
+
+	/* Magnitude in 1/256 of full scale, differential results span half the range per sign */
+	if (adc_channel_table[channel].mode == 0x00)
+		level = raw >> (4 + shift);
 	else
-		return (float)( adc_vref * (ADC0.RES >> 4) / 2048);	// differential resolution is 11 bits -> 2048 values
+	{
+		int16_t value = (int16_t)raw;
+		level = (uint16_t)((value < 0) ? -value : value) >> (3 + shift);
+	}
+
+	if (level >= ADC_RANGE_CLIP_Q8 && ref + 1 < adc_reference_count)
+	{
+		adc_channel_reference[channel] = ref + 1;
+		return 0x01;
+	}
+	if (level >= ADC_RANGE_UP_Q8 && ref + 1 < adc_reference_count)
+		adc_channel_reference[channel] = ref + 1;
+	else if (ref > 0 && (((uint32_t)level * adc_reference_table[ref].down_q8) >> 8) <= ADC_RANGE_DOWN_Q8)
+		adc_channel_reference[channel] = ref - 1;
+	return 0x00;
 }
 //***************************************************************************
 //
-// Function Name : "batteryCell_read"
+// Function Name : "ADC_scan_load"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Programs ADC0 for one entry of the channel descriptor table: conversion
+//	mode, input multiplexers and accumulation. Settling conversions are run
+//	without accumulation, the descriptor's accumulation is applied to the
+//	conversion whose result is kept. A channel with a settle timeout of 0
+//	is converted right away. Auto-ranging channels get the reference picked
+//	by their last scan and an accumulation reduced by what the smaller
+//	reference gains, other channels are converted on VDD at their full
+//	accumulation unless ADC_reference_pin() put them on another reference.
+//	A reference change always settles first.
+//
+// Inputs :
+//		uint8_t channel: index into adc_channel_table (ADC_CHANNEL_ID)
+//
+// Outputs : None
+//
+//**************************************************************************
+static void ADC_scan_load(uint8_t channel)
+{
+	const adc_channel_descriptor *desc = &adc_channel_table[channel];
+
+	uint8_t ref = adc_channel_reference[channel];	// VDD for other channels unless pinned elsewhere
+	uint8_t reduction = desc->autorange ? adc_reference_table[ref].sampnum_reduction : 0;
+
+	ADC_select(channel);
+	adc_scan_sampnum = (desc->sampnum > reduction) ? desc->sampnum - reduction : ADC_SAMPNUM_NONE_gc;
+	adc_scan_settle_min = ADC_reference_select(ref) ? ADC_REF_SETTLE_CONVERSIONS : 0;
+
+	adc_scan_settle_count = 0;
+	adc_scan_settling = (desc->settle_timeout != 0) || (adc_scan_settle_min != 0);
+	if (adc_scan_settling)
+		ADC0.CTRLB = ADC_SAMPNUM_NONE_gc;	// single quick conversions while the input settles
+	else
+	{
+		ADC0.CTRLB = adc_scan_sampnum;
+		adc_scan_start_time = timestamp_now();
+	}
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_start"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Starts a conversion on ADC0 for one battery in the quad pack,
-// reads the result, and converts the result back to an
-// analog voltage
+//	Starts a scan of the given sequence of channel descriptors and returns
+//	immediately. The RESRDY interrupt walks the sequence and drops one
+//	result per channel into the ring buffer. The sequence array must stay
+//	valid until the scan finishes. No scan is started while the window
+//	comparator monitor or the sample clock owns the ADC.
 //
-// Inputs : 
-//	uint8_t BAT_POS: Positive battery terminal
-//	uint8_t BAT_NEG: Negative battery terminal
+// Inputs :
+//		const uint8_t *sequence: channel IDs (ADC_CHANNEL_ID) to convert in order
+//		uint8_t length: number of channels in the sequence
 //
 // Outputs :
-//	float result: the analog voltage across the battery
+//		uint8_t started: 0x01 if the scan was started, 0x00 if a scan is already running
+//
+//**************************************************************************
+uint8_t ADC_scan_start(const uint8_t *sequence, uint8_t length)
+{
+	if (adc_scan_busy || adc_monitor_armed || adc_clocked || length == 0)
+		return 0x00;
+
+	adc_scan_sequence = sequence;
+	adc_scan_length = length;
+	adc_scan_index = 0;
+	adc_scan_busy = 0x01;
+
+	ADC0.INTFLAGS = ADC_RESRDY_bm;	// clear any stale result
+	ADC_scan_load(sequence[0]);
+	ADC_startConversion();
+	return 0x01;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_ring_push"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Stores a finished result in the ring buffer. Called from the RESRDY
+//	interrupt, the oldest entry is dropped if the consumer fell behind.
+//
+// Inputs :
+//		uint8_t channel: channel ID that produced the result
+//		uint16_t raw: ADC0.RES
+//		uint16_t timestamp: TCB1 timestamp of the result
+//		uint16_t sequence: sample clock sequence number, 0 for sequencer scans
+//
+// Outputs : None
+//
+//**************************************************************************
+static void ADC_ring_push(uint8_t channel, uint16_t raw, uint16_t timestamp, uint16_t sequence)
+{
+	uint8_t next_head = (adc_ring_head + 1) & (ADC_RING_SIZE - 1);
+	if (next_head == adc_ring_tail)
+		adc_ring_tail = (adc_ring_tail + 1) & (ADC_RING_SIZE - 1);
+	adc_ring[adc_ring_head].channel = channel;
+	adc_ring[adc_ring_head].sampnum = ADC0.CTRLB & ADC_SAMPNUM_gm;
+	adc_ring[adc_ring_head].raw = raw;
+	adc_ring[adc_ring_head].timestamp = timestamp;
+	adc_ring[adc_ring_head].sequence = sequence;
+	adc_ring[adc_ring_head].reference = adc_reference_active;
+	adc_ring_head = next_head;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_service"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Body of the RESRDY interrupt. Reads the finished conversion, either
+//	discards it while the input settles or stores it in the ring buffer,
+//	then programs and starts the next conversion of the sequence.
+//	Results started by the sample clock are stored with their sequence
+//	number, a gap in the sequence counts as a missed sample. Without a
+//	sequence the multi-rate scheduler takes the result and picks the
+//	channel of the next event.
+//	The input counts as settled once two consecutive single conversions
+//	agree within adc_settle_tolerance, or when the channel's settle
+//	timeout runs out, and never before ADC_REF_SETTLE_CONVERSIONS after a
+//	reference change. Kept results of auto-ranging channels pick the
+//	reference of their next scan. The number of conversions it took is recorded in
+//	adc_settle_statistics, so a scan lasts only as long as the source
+//	impedance of each channel requires.
+//
+// Inputs : none
+//
+// Outputs : none
 //
 //**************************************************************************
-float batteryCell_read(uint8_t BAT_POS, uint8_t BAT_NEG)
-{	
-	/* B1- is connected to GND to single-ended has better resolution */
-	if (BAT_POS == B1_ADC_CHANNEL)
-		ADC_init(0x00);	
-	/* Otherwise make differential measurement */
+void ADC_scan_service(void)
+{
+	uint16_t raw = ADC0.RES;	// reading ADC.RES clears interrupt flag
+
+	/* Hardware-timed sample: the sample clock already started it, just keep it */
+	if (adc_clocked)
+	{
+		uint8_t index = adc_clocked_index;
+		uint8_t channel = adc_clocked_channel;
+		uint16_t sequence = sample_clock_count();	// includes the event that started this conversion
+		adc_clocked_missed += (uint16_t)(sequence - adc_clocked_last_sequence - 1);
+		adc_clocked_last_sequence = sequence;
+
+		/* A running capture or the scheduler takes the result instead of the ring buffer */
+		if (capture_isRunning())
+		{
+			adc_result result = {channel, ADC0.CTRLB & ADC_SAMPNUM_gm, raw, timestamp_now(), sequence, adc_reference_active};
+			capture_store(index, result);
+		}
+		else if (adc_clocked_sequence == NULL)
+		{
+			adc_result result = {channel, ADC0.CTRLB & ADC_SAMPNUM_gm, raw, timestamp_now(), sequence, adc_reference_active};
+			scheduler_store(result);
+		}
+		else
+			ADC_ring_push(channel, raw, timestamp_now(), sequence);
+
+		/* Select the next channel now, its input settles until the next event */
+		if (adc_clocked)
+		{
+			if (adc_clocked_sequence == NULL)
+				channel = scheduler_next();
+			else
+			{
+				adc_clocked_index = (index + 1 < adc_clocked_length) ? index + 1 : 0;
+				channel = adc_clocked_sequence[adc_clocked_index];
+			}
+			adc_clocked_channel = channel;
+			ADC_select(channel);
+			ADC0.CTRLB = adc_channel_table[channel].sampnum;
+		}
+		return;
+	}
+
+	if (!adc_scan_busy)
+		return;
+
+	/* Still settling: compare with the previous single conversion */
+	if (adc_scan_settling)
+	{
+		uint8_t channel = adc_scan_sequence[adc_scan_index];
+		int16_t value = (int16_t)raw;	// 12 bits, sign extended in differential mode
+		int16_t change = value - adc_scan_settle_last;
+		uint8_t settled = (adc_scan_settle_count != 0) && (adc_scan_settle_count >= adc_scan_settle_min)
+						  && (change <= adc_settle_tolerance) && (-change <= adc_settle_tolerance);
+
+		adc_scan_settle_last = value;
+		adc_scan_settle_count++;
+
+		if (!settled && adc_scan_settle_count >= adc_channel_table[channel].settle_timeout
+			&& adc_scan_settle_count >= adc_scan_settle_min)
+		{
+			adc_settle_statistics[channel].timeouts++;
+			settled = 0x01;	// give up waiting, convert anyway
+		}
+
+		/* Settled: record statistic and restore the accumulation before the conversion that is kept */
+		if (settled)
+		{
+			adc_settle_statistics[channel].last_conversions = adc_scan_settle_count;
+			if (adc_scan_settle_count > adc_settle_statistics[channel].max_conversions)
+				adc_settle_statistics[channel].max_conversions = adc_scan_settle_count;
+			adc_scan_settling = 0x00;
+			ADC0.CTRLB = adc_scan_sampnum;
+			adc_scan_start_time = timestamp_now();
+		}
+		ADC_startConversion();
+		return;
+	}
+
+	/* A clipped result on a too small reference is converted again on the next larger one */
+	uint8_t channel = adc_scan_sequence[adc_scan_index];
+	if (adc_channel_table[channel].autorange && ADC_autorange(channel, raw, adc_scan_sampnum))
+	{
+		ADC_scan_load(channel);
+		ADC_startConversion();
+		return;
+	}
+
+	/* Time-stamp the result at the middle of its accumulation and keep it */
+	uint16_t end_time = timestamp_now();
+	uint16_t timestamp = adc_scan_start_time + ((uint16_t)(end_time - adc_scan_start_time) >> 1);
+	ADC_ring_push(adc_scan_sequence[adc_scan_index], raw, timestamp, 0);
+
+	/* Move on to the next channel or finish the scan */
+	adc_scan_index++;
+	if (adc_scan_index < adc_scan_length)
+	{
+		ADC_scan_load(adc_scan_sequence[adc_scan_index]);
+		ADC_startConversion();
+	}
 	else
-		ADC_init(0x01);	
-	
-	/* Select ADC channel and wait for it to settle*/	
-	ADC_channelSEL(BAT_POS, BAT_NEG);
-	_delay_ms(10);
-	
-	/* Multiply by voltage divider ratio to undo attenuation */
-	return (float) (ADC_read() * battery_voltage_divider_ratios);
+		adc_scan_busy = 0x00;
+}
+
+ISR(ADC0_RESRDY_vect)
+{
+	ADC_scan_service();
 }
 //***************************************************************************
 //
-// Function Name : "read_UNLOADED_battery_voltages"
+// Function Name : "ADC_scan_isBusy"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Reports whether the scan sequencer is still converting.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t busy: 0x01 while a scan is in progress, 0x00 when idle
+//
+//**************************************************************************
+uint8_t ADC_scan_isBusy(void)
+{
+	return adc_scan_busy;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_wait"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-//  Reads the voltage across each battery cell input and stores the results 
-//	in the UNLOADED_battery_voltgaes array
+//	Waits for the running scan to finish. When called with global
+//	interrupts masked (from an ISR) the RESRDY flag is serviced here
+//	instead of by the ADC interrupt.
+//
 // Inputs : none
 //
 // Outputs : none
 //
+//**************************************************************************
+void ADC_scan_wait(void)
+{
+	while (adc_scan_busy)
+	{
+		if (!(SREG & CPU_I_bm) && ADC_isConversionDone())
+			ADC_scan_service();
+	}
+}
+//***************************************************************************
+//
+// Function Name : "ADC_ring_pop"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Removes the oldest result from the ring buffer.
+//
+// Inputs :
+//		adc_result *result: destination for the oldest result
+//
+// Outputs :
+//		uint8_t available: 0x01 if a result was copied, 0x00 if the ring was empty
 //
 //**************************************************************************
-void read_UNLOADED_battery_voltages(void)
+uint8_t ADC_ring_pop(adc_result *result)
 {
-	/* Read voltage of each cell and store in array when unloaded */
-	current_test_result.UNLOADED_battery_voltages[0] = batteryCell_read(B1_ADC_CHANNEL, GND_ADC_CHANNEL);	// B1_POS - GND
-	current_test_result.UNLOADED_battery_voltages[1] = batteryCell_read(B2_ADC_CHANNEL, B1_ADC_CHANNEL);	// B2_POS - B1_POS
-	current_test_result.UNLOADED_battery_voltages[2] = batteryCell_read(B3_ADC_CHANNEL, B2_ADC_CHANNEL);	// B3_POS - B2_POS
-	current_test_result.UNLOADED_battery_voltages[3] = batteryCell_read(B4_ADC_CHANNEL, B3_ADC_CHANNEL);	// B4_POS - B3_POS
+	if (adc_ring_tail == adc_ring_head)
+		return 0x00;
+
+	result->channel = adc_ring[adc_ring_tail].channel;
+	result->sampnum = adc_ring[adc_ring_tail].sampnum;
+	result->raw = adc_ring[adc_ring_tail].raw;
+	result->timestamp = adc_ring[adc_ring_tail].timestamp;
+	result->sequence = adc_ring[adc_ring_tail].sequence;
+	result->reference = adc_ring[adc_ring_tail].reference;
+	adc_ring_tail = (adc_ring_tail + 1) & (ADC_RING_SIZE - 1);
+	return 0x01;
 }
 //***************************************************************************
 //
-// Function Name : "read_LOADED_battery_voltages"
+// Function Name : "ADC_ring_flush"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Discards every result still waiting in the ring buffer.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_ring_flush(void)
+{
+	adc_ring_tail = adc_ring_head;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_clocked_start"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Converts a sequence of channels round robin, one channel per sample
+//	clock event. Conversions are started in hardware by the RTC through the
+//	event system, so the sample interval does not depend on what the CPU
+//	is doing. The next channel is selected as soon as a result is read and
+//	settles until the next event. Results go to the ring buffer, or to a
+//	running capture, with a sequence number: consecutive results differ by
+//	1 unless a sample was missed. Without a sequence the multi-rate
+//	scheduler chooses the channel of every event and takes the results.
+//	The ADC belongs to the sample clock until ADC_clocked_stop() is called.
+//
+// Inputs :
+//		const uint8_t *sequence: channel IDs (ADC_CHANNEL_ID) to sample in turn, NULL for the scheduler
+//		uint8_t length: number of channels in the sequence, ignored for the scheduler
+//		uint16_t rate_hz: conversions per second, 1 ... SAMPLE_CLOCK_MAX_HZ
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_clocked_start(const uint8_t *sequence, uint8_t length, uint16_t rate_hz)
+{
+	ADC_scan_wait();	// let any background scan finish first
+
+	/* No settling conversions, the input has a whole sample period to settle */
+	ADC_reference_widest();
+	adc_clocked_channel = (sequence == NULL) ? scheduler_next() : sequence[0];
+	ADC_select(adc_clocked_channel);
+	ADC0.CTRLB = adc_channel_table[adc_clocked_channel].sampnum;
+
+	adc_clocked_sequence = sequence;
+	adc_clocked_length = length;
+	adc_clocked_index = 0;
+	adc_clocked_last_sequence = 0;
+	adc_clocked_missed = 0;
+	ADC_ring_flush();
+	ADC0.INTFLAGS = ADC_RESRDY_bm;
+	adc_clocked = 0x01;
+
+	ADC0.EVCTRL = ADC_STARTEI_bm;	// Start a conversion on every event
+	sample_clock_start(rate_hz);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_clocked_stop"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-//  Reads the voltage across each battery cell input and stores the results
-//	in the LOADED_battery_voltgaes array
+//	Stops hardware-timed sampling and hands the ADC back to the scan
+//	sequencer. Results still in the ring buffer can be popped afterwards.
+//
 // Inputs : none
 //
 // Outputs : none
 //
+//**************************************************************************
+void ADC_clocked_stop(void)
+{
+	sample_clock_stop();
+	ADC0.EVCTRL = 0x00;
+	ADC_stopConversion();
+	ADC0.INTFLAGS = ADC_RESRDY_bm;
+	adc_clocked = 0x00;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_code_to_raw"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Inverse of ADC_code for the current settings of a channel: converts a
+//	normalized code to the value ADC0.RES holds for it, so thresholds can
+//	be written to the window comparator registers. Clamped to the range
+//	of the result register.
+//
+// Inputs :
+//		uint8_t channel: channel ID (ADC_CHANNEL_ID)
+//		int32_t code: value in 1/65536 of VREF
+//
+// Outputs :
+//		uint16_t raw: equivalent ADC0.RES value
 //
 //**************************************************************************
-void read_LOADED_battery_voltages(void)
+uint16_t ADC_code_to_raw(uint8_t channel, int32_t code)
 {
-	/* Read voltage of each cell and store in array once load current reaches 500A */
-	current_test_result.LOADED_battery_voltages[0] = batteryCell_read(B1_ADC_CHANNEL, GND_ADC_CHANNEL);	// B1_POS - GND
-	current_test_result.LOADED_battery_voltages[1] = batteryCell_read(B2_ADC_CHANNEL, B1_ADC_CHANNEL);	// B2_POS - B1_POS
-	current_test_result.LOADED_battery_voltages[2] = batteryCell_read(B3_ADC_CHANNEL, B2_ADC_CHANNEL);	// B3_POS - B2_POS
-	current_test_result.LOADED_battery_voltages[3] = batteryCell_read(B4_ADC_CHANNEL, B3_ADC_CHANNEL);	// B4_POS - B3_POS
+	const adc_channel_descriptor *desc = &adc_channel_table[channel];
+
+	/* Amplifier codes are given without offset or gain error, the ADC sees both */
+	if (channel == ADC_CH_LOAD_CURRENT)
+	{
+		if (code > 0)
+			code = (int32_t)(((uint32_t)code * OPAMP_CAL_ONE + (opamp_gain_correction(code) >> 1)) / opamp_gain_correction(code));
+		code += opamp_offset_code;
+	}
+
+	if (desc->mode != 0x00)
+		code /= 2;	// differential codes carry one extra bit of weight
+	if (desc->sampnum < 4)
+		code /= (int32_t)1 << (4 - desc->sampnum);
+
+	/* Single-ended results are unsigned, differential results are two's complement */
+	if (desc->mode == 0x00)
+	{
+		if (code < 0)
+			code = 0;
+		else if (code > 0xFFFF)
+			code = 0xFFFF;
+	}
+	else if (code < -32768)
+		code = -32768;
+	else if (code > 32767)
+		code = 32767;
+	return (uint16_t)code;
 }
+//***************************************************************************
+//
+// Function Name : "ADC_monitor_start"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Lets one channel free-run against a threshold in the ADC window
+//	comparator. Each accumulated result is compared in hardware and the
+//	WCMP interrupt fires on the first one past the threshold, so the
+//	crossing is caught within one conversion without the CPU polling.
+//	On the crossing the monitor stops and the optional capture scan is
+//	started straight from the interrupt. The ADC belongs to the monitor
+//	until the threshold is crossed or ADC_monitor_stop() is called.
+//
+// Inputs :
+//		uint8_t channel: channel ID (ADC_CHANNEL_ID) to monitor
+//		uint8_t window_mode: ADC_WINCM_ABOVE_gc or ADC_WINCM_BELOW_gc
+//		int32_t threshold_code: threshold in 1/65536 of VREF
+//		const uint8_t *capture: scan sequence to start on the crossing, NULL for none
+//		uint8_t capture_length: number of channels in the capture sequence
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_monitor_start(uint8_t channel, uint8_t window_mode, int32_t threshold_code,
+					   const uint8_t *capture, uint8_t capture_length)
+{
+	const adc_channel_descriptor *desc = &adc_channel_table[channel];
+	uint16_t threshold = ADC_code_to_raw(channel, threshold_code);
+
+	ADC_scan_wait();	// let any background scan finish first
+	if (adc_clocked)
+		ADC_clocked_stop();
+
+	adc_monitor_channel = channel;
+	adc_monitor_capture = capture;
+	adc_monitor_capture_length = capture_length;
+	adc_monitor_latched = 0x00;
+
+	/* Program the channel without settling, free-running keeps the input selected */
+	ADC_reference_widest();
+	ADC_select(channel);
+	ADC0.CTRLB = desc->sampnum;
 
+	/* One threshold is used in both registers, ABOVE compares to WINHT and BELOW to WINLT */
+	ADC0.WINLT = threshold;
+	ADC0.WINHT = threshold;
+	ADC0.CTRLE = window_mode;
+
+	/* Only the comparator interrupts, results are read on demand by ADC_monitor_read() */
+	ADC0.INTCTRL = (ADC0.INTCTRL & ~ADC_RESRDY_bm) | ADC_WCMP_bm;
+	ADC0.INTFLAGS = (ADC_RESRDY_bm | ADC_WCMP_bm);
+	adc_monitor_armed = 0x01;
+
+	ADC0.CTRLA |= ADC_FREERUN_bm;
+	ADC_startConversion();
+}
 //***************************************************************************
 //
-// Function Name : "OPAMP_Instrumentation_init"
+// Function Name : "ADC_monitor_stop"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// This function reads output of the instrumentation amplifier and converts
-//	it to a current based on the shunt resistance value.
+//	Stops the free-running monitor and hands the ADC back to the scan
+//	sequencer.
 //
 // Inputs : none
 //
 // Outputs : none
-//		float load_current: Analog Load current through shunt in amps
 //
 //**************************************************************************
-float load_current_Read(void)
-{	
-	/* Put ADC in single-ended mode and select OP2 output */
-	ADC_init(0x00);
-	ADC_channelSEL(OPAMP_ADC_CHANNEL, GND_ADC_CHANNEL);
-	adc_value = ADC_read();		
-	
-	/* Multiply by divider ratio to undo attenuation, divide by gain to undo gain, divide by resistance to convert to amps */
-	load_current_amps = ((adc_value*current_sensing_voltage_divider_ratios) / (OPAMP_gain*shunt_resistance_ohms));	
-	
-	if(load_current_amps < 10)
-		return 0;
-	else
-		return load_current_amps;
-}
\ No newline at end of file
+void ADC_monitor_stop(void)
+{
+	adc_monitor_armed = 0x00;
+	ADC0.CTRLA &= ~ADC_FREERUN_bm;
+	ADC_stopConversion();
+	ADC0.CTRLE = ADC_WINCM_NONE_gc;
+	ADC0.INTCTRL = (ADC0.INTCTRL & ~ADC_WCMP_bm) | ADC_RESRDY_bm;
+	ADC0.INTFLAGS = (ADC_RESRDY_bm | ADC_WCMP_bm);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_monitor_service"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Body of the WCMP interrupt. Latches the result that crossed the
+//	threshold, stops the monitor and starts the capture scan right away.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_monitor_service(void)
+{
+	uint16_t raw = ADC0.RES;
+
+	if (!adc_monitor_armed)
+	{
+		ADC0.INTFLAGS = ADC_WCMP_bm;
+		return;
+	}
+
+	adc_monitor_raw = raw;
+	ADC_monitor_stop();
+	adc_monitor_latched = 0x01;
+
+	if (adc_monitor_capture != NULL)
+	{
+		ADC_ring_flush();
+		ADC_scan_start(adc_monitor_capture, adc_monitor_capture_length);
+	}
+}
+
+ISR(ADC0_WCMP_vect)
+{
+	ADC_monitor_service();
+}
+//***************************************************************************
+//
+// Function Name : "ADC_monitor_isLatched"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Reports whether the monitored threshold has been crossed. With global
+//	interrupts masked the WCMP flag is serviced here instead.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t latched: 0x01 once the threshold was crossed, 0x00 before
+//
+//**************************************************************************
+uint8_t ADC_monitor_isLatched(void)
+{
+	if (!(SREG & CPU_I_bm) && (ADC0.INTFLAGS & ADC_WCMP_bm))
+		ADC_monitor_service();
+	return adc_monitor_latched;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_monitor_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Returns the latest result of the monitored channel as a normalized
+//	code for display, or the result that crossed the threshold once the
+//	monitor has latched.
+//
+// Inputs : none
+//
+// Outputs :
+//		int32_t code: result in 1/65536 of VREF
+//
+//**************************************************************************
+int32_t ADC_monitor_read(void)
+{
+	adc_result result;
+	uint8_t sreg = SREG;
+
+	result.channel = adc_monitor_channel;
+	result.sampnum = adc_channel_table[adc_monitor_channel].sampnum;
+	result.timestamp = 0;
+	result.sequence = 0;
+	result.reference = adc_reference_active;
+
+	/* 16-bit read through TEMP, masked against the WCMP ISR */
+	cli();
+	result.raw = adc_monitor_latched ? adc_monitor_raw : ADC0.RES;
+	SREG = sreg;
+
+	return ADC_code(result);
+}
+//***************************************************************************
+//
+// Function Name : "fixed_point_scale_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Precomputes an integer scale factor equal to numerator/denominator.
+//	The multiplier is normalized with the largest right shift that still
+//	keeps max_code * multiplier inside a signed 32-bit result, so applying
+//	the scale costs one 32-bit multiply and a shift. Only called at
+//	start-up or when a calibration constant changes.
+//
+// Inputs :
+//		fixed_point_scale *scale: scale factor to initialize
+//		uint64_t numerator: output units per full scale code
+//		uint64_t denominator: full scale code
+//		uint32_t max_code: largest magnitude the scale will be applied to
+//
+// Outputs : none
+//
+//**************************************************************************
+void fixed_point_scale_init(fixed_point_scale *scale, uint64_t numerator, uint64_t denominator, uint32_t max_code)
+{
+	uint8_t shift = 0;
+
+	/* Increase the shift until the next one would overflow the product or the numerator */
+	while (shift < 31 && (numerator >> (62 - shift)) == 0)
+	{
+		uint64_t multiplier = ((numerator << (shift + 1)) + (denominator >> 1)) / denominator;
+		if (multiplier * max_code > 0x7FFFFFFF)
+			break;
+		shift++;
+	}
+
+	scale->multiplier = ((numerator << shift) + (denominator >> 1)) / denominator;
+	scale->shift = shift;
+}
+//***************************************************************************
+//
+// Function Name : "fixed_point_apply"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Multiplies a signed code by a precomputed scale factor with rounding.
+//
+// Inputs :
+//		const fixed_point_scale *scale: precomputed scale factor
+//		int32_t code: value to scale, magnitude no larger than the max_code
+//					  the scale was initialized with
+//
+// Outputs :
+//		int32_t result: code * numerator / denominator
+//
+//**************************************************************************
+int32_t fixed_point_apply(const fixed_point_scale *scale, int32_t code)
+{
+	uint32_t magnitude = (code < 0) ? (uint32_t)(-code) : (uint32_t)code;
+	uint32_t rounding = (scale->shift != 0) ? (1UL << (scale->shift - 1)) : 0;
+
+	magnitude = (magnitude * scale->multiplier + rounding) >> scale->shift;
+	return (code < 0) ? -(int32_t)magnitude : (int32_t)magnitude;
+}
+//***************************************************************************
+//
+// Function Name : "measurement_scales_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Precomputes the integer scale factors of the measurement pipeline from
+//	the reference voltage, divider ratios, amplifier gain and shunt value.
+//	Must be called after any of those globals change. The auto-ranging
+//	reference table is rebuilt first, its factors fold every reference
+//	into the same ADC code units.
+//		ADC code (1/65536 of VREF) -> microvolts at the ADC pin
+//		ADC code -> millivolts across a battery cell
+//		ADC code -> milliamps through the shunt
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void measurement_scales_init(void)
+{
+	ADC_reference_init();	// the reference scales depend on the supply voltage too
+
+	fixed_point_scale_init(&adc_scale_uv, (uint64_t)adc_vref_mv * 1000, ADC_CODE_FULL_SCALE, ADC_CODE_FULL_SCALE);
+	fixed_point_scale_init(&cell_scale_mv, (uint64_t)adc_vref_mv * battery_voltage_divider_ratios,
+						   ADC_CODE_FULL_SCALE, ADC_CODE_FULL_SCALE);
+
+	/* I[mA] = V[uV] * divider * 1000 / (gain * R[uOhm]) */
+	fixed_point_scale_init(&load_current_scale_ma,
+						   (uint64_t)adc_vref_mv * 1000 * current_sensing_voltage_divider_ratios * 1000,
+						   (uint64_t)ADC_CODE_FULL_SCALE * OPAMP_gain * shunt_resistance_uohms, ADC_CODE_FULL_SCALE);
+}
+//***************************************************************************
+//
+// Function Name : "load_current_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Inverse of load_current_from_code: the normalized code of the shunt
+//	amplifier channel at a given load current. Used for current thresholds,
+//	ADC_code_to_raw() adds the gain error and the offset.
+//
+// Inputs :
+//		int32_t current_ma: load current in milliamps, not negative
+//
+// Outputs :
+//		int32_t code: shunt channel code in 1/65536 of VREF
+//
+//**************************************************************************
+int32_t load_current_code(int32_t current_ma)
+{
+	uint64_t numerator = (uint64_t)current_ma * ADC_CODE_FULL_SCALE * OPAMP_gain * shunt_resistance_uohms;
+	uint64_t denominator = (uint64_t)adc_vref_mv * 1000 * current_sensing_voltage_divider_ratios * 1000;
+
+	return (int32_t)((numerator + (denominator >> 1)) / denominator);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_set_oversampling"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Changes the number of accumulated samples of one channel. Lets a
+//	measurement site pay for resolution only where it needs it, the new
+//	setting takes effect on the next scan of that channel.
+//
+// Inputs :
+//		uint8_t channel: channel ID (ADC_CHANNEL_ID)
+//		uint8_t sampnum: ADC_SAMPNUM_NONE_gc (1 sample) ... ADC_SAMPNUM_ACC128_gc
+//
+// Outputs : none
+//
+//**************************************************************************
+void ADC_set_oversampling(uint8_t channel, uint8_t sampnum)
+{
+	adc_channel_table[channel].sampnum = sampnum & ADC_SAMPNUM_gm;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_effective_bits"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Resolution gained by oversampling: 12 bits plus half a bit for every
+//	doubling of the accumulated samples, rounded down.
+//		1 -> 12, 4 -> 13, 16 -> 14, 64 -> 15, 128 -> 15 bits
+//
+// Inputs :
+//		uint8_t sampnum: ADC_SAMPNUM_xxx_gc, log2 of the accumulated samples
+//
+// Outputs :
+//		uint8_t bits: effective resolution of the decimated result
+//
+//**************************************************************************
+uint8_t ADC_effective_bits(uint8_t sampnum)
+{
+	return 12 + (sampnum >> 1);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Decodes an accumulated result from the ring buffer and decimates it to
+//	a code in units of 1/65536 of the reference voltage, so one set of
+//	scale factors serves every channel regardless of its accumulation.
+//	Up to 16 samples RES holds the full sum, beyond that the ADC has
+//	already shifted the sum right to fit 16 bits. Differential results are
+//	two's complement and are sign extended before scaling. The offset,
+//	gain and nonlinearity measured by the DAC loopback self-test for the
+//	reference, mode and accumulation are corrected next. The code is rounded to the
+//	effective resolution so noise bits below it are dropped. Results taken
+//	on an internal reference are rescaled to codes of VDD (adc_vref_mv), so
+//	the scale factors do not depend on the reference either. Shunt
+//	amplifier results lose the auto-zero offset and get the calibrated
+//	gain error at their level corrected.
+//
+// Inputs :
+//		adc_result result: Ring buffer entry to convert
+//
+// Outputs :
+//		int32_t code: result in 1/65536 of VREF, negative for differential
+//					  results where the negative input is higher
+//
+//**************************************************************************
+int32_t ADC_code(adc_result result)
+{
+	uint8_t sampnum = result.sampnum;	// log2 of the accumulated samples
+	int32_t code;
+	uint8_t step_bits;	// code LSBs below the effective resolution
+
+	/* Single-ended is unsigned 12 bits, differential is signed 12 bits spanning -VREF ... +VREF */
+	if (adc_channel_table[result.channel].mode == 0x00)
+	{
+		code = (int32_t)result.raw;
+		step_bits = 16 - ADC_effective_bits(sampnum);
+	}
+	else
+	{
+		code = (int32_t)(int16_t)result.raw * 2;	// one more bit of weight, 11 bits + sign
+		step_bits = 17 - ADC_effective_bits(sampnum);
+	}
+
+	/* Scale the sum of 2^sampnum 12-bit samples up to 16 bits, sums of more than 16 are already 16 bits */
+	if (sampnum < 4)
+		code *= (int32_t)1 << (4 - sampnum);
+
+	/* Loopback correction of the reference, mode and accumulation, in codes of that reference */
+	const adc_calibration *cal = &adc_calibration_table[result.reference][adc_channel_table[result.channel].mode][sampnum];
+	if (cal->valid)
+		code = ADC_calibrate_code(cal, code);
+
+	/* Decimate: round to the effective resolution */
+	code = (code + ((int32_t)1 << (step_bits - 1))) & ~(((int32_t)1 << step_bits) - 1);
+
+	/* Results on a smaller reference are rescaled to codes of VDD, the finer steps are kept */
+	if (result.reference != adc_reference_count - 1)
+		code = (code * (int32_t)adc_reference_table[result.reference].scale + (ADC_REF_SCALE_ONE >> 1)) >> ADC_REF_SCALE_SHIFT;
+
+	/* Amplifier results lose the auto-zero offset, then get the calibrated gain error at their
+	   level, code < 2^16 and correction <= 2^15 fit in 32 bits */
+	if (result.channel == ADC_CH_LOAD_CURRENT)
+	{
+		code -= opamp_offset_code;
+		if (code > 0)
+			code = (int32_t)(((uint32_t)code * opamp_gain_correction(code) + (OPAMP_CAL_ONE >> 1)) >> OPAMP_CAL_SHIFT);
+	}
+	return code;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Converts a result from the ring buffer to the voltage at the ADC pin
+//	in microvolts using the precomputed reference scale factor
+//
+// Inputs :
+//		adc_result result: Ring buffer entry to convert
+//
+// Outputs :
+//		int32_t result: Voltage at the ADC pin in microvolts
+//
+//**************************************************************************
+int32_t ADC_read(adc_result result)
+{
+	return fixed_point_apply(&adc_scale_uv, ADC_code(result));
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_claim"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Readies the ADC for a blocking scan: waits for a background scan,
+//	takes the ADC back from the window comparator monitor or the sample
+//	clock, like starting either of them does, and empties the ring.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void ADC_scan_claim(void)
+{
+	ADC_scan_wait();	// let any background scan finish first
+	if (adc_monitor_armed)
+		ADC_monitor_stop();
+	if (adc_clocked)
+		ADC_clocked_stop();
+	ADC_ring_flush();
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_read_timed"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Runs a scan to completion and returns every result as a normalized
+//	code together with the timestamp of the middle of its conversion.
+//	Blocking convenience wrapper around the sequencer for callers that
+//	need the values right away, see ADC_scan_claim().
+//
+// Inputs :
+//		const uint8_t *sequence: channel IDs (ADC_CHANNEL_ID) to convert in order
+//		uint8_t length: number of channels in the sequence
+//		int32_t *codes: destination, one code (1/65536 of VREF) per sequence entry
+//		uint16_t *timestamps: destination, one timestamp per sequence entry, may be NULL
+//
+// Outputs :
+//		uint8_t complete: 0x01 if every entry holds a result, 0x00 if the missing ones were set to 0
+//
+//**************************************************************************
+uint8_t ADC_scan_read_timed(const uint8_t *sequence, uint8_t length, int32_t *codes, uint16_t *timestamps)
+{
+	/* A scan that did not start leaves the ring empty, the destination is cleared */
+	ADC_scan_claim();
+	ADC_scan_start(sequence, length);
+	return (ADC_scan_collect(length, codes, timestamps) == length);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Runs a scan to completion and returns every result as a normalized
+//	code, without timestamps.
+//
+// Inputs :
+//		const uint8_t *sequence: channel IDs (ADC_CHANNEL_ID) to convert in order
+//		uint8_t length: number of channels in the sequence
+//		int32_t *codes: destination, one code (1/65536 of VREF) per sequence entry
+//
+// Outputs :
+//		uint8_t complete: 0x01 if every entry holds a result, 0x00 if the missing ones were set to 0
+//
+//**************************************************************************
+uint8_t ADC_scan_read(const uint8_t *sequence, uint8_t length, int32_t *codes)
+{
+	return ADC_scan_read_timed(sequence, length, codes, NULL);
+}
+//***************************************************************************
+//
+// Function Name : "ADC_scan_collect"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Waits for a scan that was started elsewhere (e.g. by the window
+//	comparator) and returns its results as normalized codes. Entries the
+//	ring ran out before are set to 0, never left as they were.
+//
+// Inputs :
+//		uint8_t length: number of channels in the scan
+//		int32_t *codes: destination, one code (1/65536 of VREF) per sequence entry
+//		uint16_t *timestamps: destination, one timestamp per sequence entry, may be NULL
+//
+// Outputs :
+//		uint8_t collected: results popped, less than length if the scan came up short
+//
+//**************************************************************************
+uint8_t ADC_scan_collect(uint8_t length, int32_t *codes, uint16_t *timestamps)
+{
+	adc_result result;
+	uint8_t collected = 0;
+
+	ADC_scan_wait();
+
+	for (; collected < length && ADC_ring_pop(&result); collected++)
+	{
+		codes[collected] = ADC_code(result);
+		if (timestamps != NULL)
+			timestamps[collected] = result.timestamp;
+	}
+	for (uint8_t i = collected; i < length; i++)
+	{
+		codes[i] = 0;
+		if (timestamps != NULL)
+			timestamps[i] = 0;
+	}
+	return collected;
+}
+//***************************************************************************
+//
+// Function Name : "batteryCell_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Converts one battery cell of the pack through the scan sequencer
+// and scales the result back to the voltage across the cell
+//
+// Inputs :
+//	uint8_t channel: cell channel ID, ADC_CH_B1 ... ADC_CH_B1 + PACK_CELL_COUNT - 1
+//
+// Outputs :
+//	uint16_t result: the voltage across the battery in millivolts
+//
+//**************************************************************************
+uint16_t batteryCell_read(uint8_t channel)
+{
+	uint8_t sequence[1] = {channel};
+	int32_t code;
+
+	ADC_scan_read(sequence, 1, &code);
+
+	/* Scale factor includes the voltage divider ratio to undo attenuation */
+	return (uint16_t)fixed_point_apply(&cell_scale_mv, code);
+}
+//***************************************************************************
+//
+// Function Name : "read_UNLOADED_battery_voltages"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Reads the voltage across each battery cell input MEASUREMENT_SAMPLES
+//	times and stores the mean in the UNLOADED_battery_voltgaes array in mV.
+//	A cell whose readings are noisy or implausible is measured again, up to
+//	MEASUREMENT_RETAKES times, and flagged in the quality byte if it stays bad.
+//	The cells are scanned with the strategy tap_solver_select() picked.
+// Inputs : none
+//
+// Outputs : none
+//
+//
+//**************************************************************************
+void read_UNLOADED_battery_voltages(void)
+{
+	int32_t cell_uv[PACK_CELL_COUNT];
+	uint16_t bad;
+
+	for (uint8_t attempt = 0; attempt <= MEASUREMENT_RETAKES; attempt++)
+	{
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+			measurement_stats_init(&unloaded_cell_stats[i]);
+
+		/* Across the cell taps or by subtracting single-ended taps, whichever was selected */
+		for (uint8_t n = 0; n < MEASUREMENT_SAMPLES; n++)
+		{
+			if (!tap_solver_read(cell_uv))
+				continue;	// a short scan is not a reading
+			for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+				measurement_stats_add(&unloaded_cell_stats[i], (cell_uv[i] + 500) / 1000);
+		}
+
+		bad = 0;
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+			if (measurement_stats_quality(&unloaded_cell_stats[i], UNLOADED_MAX_STDDEV_MV, CELL_MIN_MV, CELL_MAX_MV) != MEASUREMENT_OK)
+				bad |= QUALITY_UNLOADED_BAD(i);
+		if (!bad)
+			break;
+	}
+
+	/* Store the mean in array when unloaded, flag cells that never gave a clean reading */
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		current_test_result.UNLOADED_battery_voltages[i] = (uint16_t)measurement_stats_mean(&unloaded_cell_stats[i]);
+	current_test_result.quality = (current_test_result.quality & QUALITY_LOADED_MASK) | bad;
+}
+//***************************************************************************
+//
+// Function Name : "interpolate_mv"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Linear interpolation between two time-stamped readings. Timestamp
+//	differences are taken modulo 2^16 so the counter wrap is harmless.
+//
+// Inputs :
+//		int32_t v1, v2: readings taken at t1 and t2
+//		uint16_t t1, t2, t: timestamps, t1 <= t <= t2 modulo 2^16
+//
+// Outputs :
+//		int32_t v: reading at time t
+//
+//**************************************************************************
+static int32_t interpolate_mv(int32_t v1, uint16_t t1, int32_t v2, uint16_t t2, uint16_t t)
+{
+	uint16_t span = t2 - t1;
+	if (span == 0)
+		return (v1 + v2) / 2;
+	return v1 + ((v2 - v1) * (int32_t)(uint16_t)(t - t1)) / span;
+}
+//***************************************************************************
+//
+// Function Name : "read_loaded_snapshot"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Takes a time-aligned snapshot of all cells and the load current.
+//	Current and cells are interleaved in one scan (I, B1..Bn, I, Bn..B1, I)
+//	with every conversion time-stamped. Each cell is read once on either
+//	side of the middle current sample and linearly interpolated to that
+//	instant, so all readings refer to the same moment and the current
+//	stored with them is the one that was actually flowing.
+//
+// Inputs :
+//		loaded_snapshot *snapshot: destination for the aligned readings
+//
+// Outputs :
+//		uint8_t complete: 0x01 if the scan returned every conversion
+//
+//**************************************************************************
+uint8_t read_loaded_snapshot(loaded_snapshot *snapshot)
+{
+	ADC_scan_claim();
+	ADC_scan_start(adc_scan_snapshot, LOADED_SNAPSHOT_LENGTH);
+	return collect_loaded_snapshot(snapshot);
+}
+//***************************************************************************
+//
+// Function Name : "collect_loaded_snapshot"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Waits for a running adc_scan_snapshot scan, started by
+//	read_loaded_snapshot() or by the window comparator, and aligns its
+//	results to the instant of the middle current sample.
+//
+// Inputs :
+//		loaded_snapshot *snapshot: destination for the aligned readings
+//
+// Outputs :
+//		uint8_t complete: 0x01 if the scan returned every conversion
+//
+//**************************************************************************
+uint8_t collect_loaded_snapshot(loaded_snapshot *snapshot)
+{
+	int32_t codes[LOADED_SNAPSHOT_LENGTH];
+	uint16_t times[LOADED_SNAPSHOT_LENGTH];
+	const uint8_t middle = LOADED_SNAPSHOT_LENGTH / 2;	// index of the middle current sample
+	uint16_t instant;
+	uint8_t complete;
+
+	complete = (ADC_scan_collect(LOADED_SNAPSHOT_LENGTH, codes, times) == LOADED_SNAPSHOT_LENGTH);
+	instant = times[middle];
+
+	/* Cell i is at index 1 + i on the way forward and at LENGTH - 2 - i on the way back */
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+	{
+		uint8_t fwd = 1 + i;
+		uint8_t bwd = LOADED_SNAPSHOT_LENGTH - 2 - i;
+		int32_t v1 = fixed_point_apply(&cell_scale_mv, codes[fwd]);
+		int32_t v2 = fixed_point_apply(&cell_scale_mv, codes[bwd]);
+		snapshot->cell_mv[i] = (uint16_t)interpolate_mv(v1, times[fwd], v2, times[bwd], instant);
+	}
+
+	snapshot->current_ma = load_current_from_code(codes[middle]);
+	snapshot->current_drift_ma = load_current_from_code(codes[LOADED_SNAPSHOT_LENGTH - 1])
+								 - load_current_from_code(codes[0]);
+	snapshot->window_us = (uint16_t)(times[LOADED_SNAPSHOT_LENGTH - 1] - times[0]) / TIMESTAMP_TICKS_PER_US;
+	return complete;
+}
+//***************************************************************************
+//
+// Function Name : "store_LOADED_battery_voltages"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Completes the loaded measurement that starts with the given snapshot:
+//	takes MEASUREMENT_SAMPLES snapshots in all and stores the mean cell
+//	voltages in the LOADED_battery_voltgaes array together with the mean
+//	load current. Noisy or implausible readings are retaken as a whole,
+//	up to MEASUREMENT_RETAKES times, and flagged if they stay bad. A
+//	snapshot whose scan came up short is left out of the statistics.
+// Inputs :
+//		const loaded_snapshot *snapshot: first aligned readings
+//		uint8_t complete: 0x01 if the first snapshot holds every conversion
+//
+// Outputs : none
+//
+//**************************************************************************
+static void store_LOADED_battery_voltages(const loaded_snapshot *snapshot, uint8_t complete)
+{
+	loaded_snapshot next = *snapshot;
+	uint16_t bad;
+
+	for (uint8_t attempt = 0; attempt <= MEASUREMENT_RETAKES; attempt++)
+	{
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+			measurement_stats_init(&loaded_cell_stats[i]);
+		measurement_stats_init(&loaded_current_stats);
+
+		for (uint8_t n = 0; n < MEASUREMENT_SAMPLES; n++)
+		{
+			if (attempt != 0 || n != 0)
+				complete = read_loaded_snapshot(&next);
+			if (!complete)
+				continue;
+			for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+				measurement_stats_add(&loaded_cell_stats[i], next.cell_mv[i]);
+			measurement_stats_add(&loaded_current_stats, next.current_ma);
+		}
+
+		bad = 0;
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+			if (measurement_stats_quality(&loaded_cell_stats[i], LOADED_MAX_STDDEV_MV, CELL_MIN_MV, CELL_MAX_MV) != MEASUREMENT_OK)
+				bad |= QUALITY_LOADED_BAD(i);
+		if (!bad)
+			break;
+	}
+
+	/* Store mean cell voltages and the mean current they were measured at once load current reaches 500A */
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		current_test_result.LOADED_battery_voltages[i] = (uint16_t)measurement_stats_mean(&loaded_cell_stats[i]);
+	current_test_result.max_load_current = (uint16_t)(measurement_stats_mean(&loaded_current_stats) / 1000);
+	current_test_result.quality = (current_test_result.quality & QUALITY_UNLOADED_MASK) | bad;
+	last_loaded_snapshot = next;
+}
+
+//***************************************************************************
+//
+// Function Name : "read_LOADED_battery_voltages"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Takes a time-aligned loaded snapshot and stores the cell voltages in
+//	the LOADED_battery_voltgaes array in mV, together with the load
+//	current at the same instant
+// Inputs : none
+//
+// Outputs : none
+//
+//
+//**************************************************************************
+void read_LOADED_battery_voltages(void)
+{
+	loaded_snapshot snapshot;
+
+	store_LOADED_battery_voltages(&snapshot, read_loaded_snapshot(&snapshot));
+}
+//***************************************************************************
+//
+// Function Name : "collect_LOADED_battery_voltages"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Same as read_LOADED_battery_voltages, for the snapshot scan the window
+//	comparator already started when the load current crossed 500A
+// Inputs : none
+//
+// Outputs : none
+//
+//
+//**************************************************************************
+void collect_LOADED_battery_voltages(void)
+{
+	loaded_snapshot snapshot;
+
+	store_LOADED_battery_voltages(&snapshot, collect_loaded_snapshot(&snapshot));
+}
+//***************************************************************************
+//
+// Function Name : "load_current_Read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// This function reads output of the instrumentation amplifier through the
+//	scan sequencer and converts it to a current based on the shunt
+//	resistance value, using only integer math. The amplifier offset is
+//	removed by ADC_code(), only the noise floor is cut off.
+//
+// Inputs : none
+//
+// Outputs : none
+//		int32_t load_current: Load current through shunt in milliamps
+//
+//**************************************************************************
+int32_t load_current_Read(void)
+{
+	/* Single-ended conversion of OP2 output */
+	int32_t code;
+	ADC_scan_read(adc_scan_load_current, 1, &code);
+	adc_value_uv = fixed_point_apply(&adc_scale_uv, code);
+
+	/* Corrects the calibrated gain error, undoes divider attenuation and amplifier gain and divides by the shunt resistance */
+	load_current_ma = load_current_from_code(code);
+
+	if(load_current_ma < LOAD_CURRENT_DEADBAND_MA)
+		return 0;
+	else
+		return load_current_ma;
+}
+//***************************************************************************
+//
+// Function Name : "temperature_from_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Converts a reading of the internal temperature sensor to degrees
+//	Celsius with the factory calibration in the signature row. The
+//	calibration is given for 12-bit results at a 2.048V reference, the
+//	code is rescaled from adc_vref_mv first, with 4 extra fraction bits.
+//
+// Inputs :
+//		int32_t code: ADC_CH_TEMPERATURE result in 1/65536 of VREF
+//
+// Outputs :
+//		int16_t temperature: die temperature in degrees Celsius
+//
+//**************************************************************************
+int16_t temperature_from_code(int32_t code)
+{
+	int32_t reading_q4 = (int32_t)(((uint32_t)code * adc_vref_mv) >> 11);	// 12-bit result at 2.048V, 4 fraction bits
+	int32_t offset_q4 = (int32_t)SIGROW.TEMPSENSE1 << 4;
+	int64_t kelvin_q16 = (int64_t)(offset_q4 - reading_q4) * SIGROW.TEMPSENSE0;
+
+	return (int16_t)(((kelvin_q16 + 0x8000) >> 16) - 273);
+}
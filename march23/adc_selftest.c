@@ -0,0 +1,189 @@
+#include "main.h"
+
+/* Loopback correction per reference, conversion mode and accumulation, rebuilt at every power-up */
+adc_calibration adc_calibration_table[ADC_REFERENCES][2][ADC_SAMPNUM_SETTINGS];
+
+//***************************************************************************
+//
+// Function Name : "ADC_selftest_fit"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Least-squares straight line through the loopback points of one
+//	configuration, expected = (measured - offset) * gain, followed by the
+//	residual at every point as the integral nonlinearity. Done once per
+//	configuration at start-up, so 64-bit math is fine here.
+//
+// Inputs :
+//		const int32_t *measured: ADC codes read at DAC levels 1 ... ADC_CAL_POINTS
+//		adc_calibration *cal: destination for offset, gain and INL table
+//
+// Outputs :
+//		uint8_t valid: 0x01 if offset, gain and nonlinearity are plausible
+//
+//**************************************************************************
+static uint8_t ADC_selftest_fit(const int32_t *measured, adc_calibration *cal)
+{
+	int64_t sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int64_t n = ADC_CAL_POINTS;
+	int64_t gain, offset;
+	uint8_t valid;
+
+	for (uint8_t k = 0; k < ADC_CAL_POINTS; k++)
+	{
+		int64_t x = measured[k];
+		int64_t y = (int64_t)(k + 1) * ADC_CAL_STEP;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+	if (n * sxx == sx * sx)
+		return 0x00;	// all readings equal, nothing is connected
+
+	gain = ((n * sxy - sx * sy) * ADC_CAL_ONE) / (n * sxx - sx * sx);
+	if (gain <= 0)
+		return 0x00;
+	offset = (sx - (sy * ADC_CAL_ONE) / gain) / n;
+
+	valid = (gain >= ADC_CAL_ONE - ADC_CAL_ONE / 10) && (gain <= ADC_CAL_ONE + ADC_CAL_ONE / 10)
+			&& (offset > -ADC_CAL_MAX_OFFSET) && (offset < ADC_CAL_MAX_OFFSET);
+	if (!valid)
+		return 0x00;
+
+	cal->offset = (int16_t)offset;
+	cal->gain = (uint16_t)gain;
+
+	/* Whatever the straight line leaves at each point is nonlinearity */
+	for (uint8_t k = 0; k < ADC_CAL_POINTS; k++)
+	{
+		int32_t linear = ((measured[k] - cal->offset) * (int32_t)cal->gain) >> ADC_CAL_SHIFT;
+		int32_t residual = (int32_t)(k + 1) * ADC_CAL_STEP - linear;
+		if (residual <= -ADC_CAL_MAX_INL || residual >= ADC_CAL_MAX_INL)
+			return 0x00;
+		cal->inl[k] = (int16_t)residual;
+	}
+	return 0x01;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_selftest_characterize"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Drives known DAC0 levels into ADC0 through the analog mux and builds
+//	an offset, gain and integral nonlinearity table for every reference
+//	auto-ranging can pick, conversion mode and accumulation setting. DAC0
+//	is switched to the same reference as the ADC for each, so the expected
+//	code is the DAC level itself and the result does not depend on the
+//	reference voltage. The codes come back rescaled to VDD and are turned
+//	back into codes of the reference for the fit. Differential mode is
+//	measured as DAC0 - GND, the positive half the cell channels use. A
+//	setting whose fit is implausible is left uncorrected. Takes well under
+//	a second, so drift is re-checked at every power-up.
+//	The tables are shared by all channels, not one per channel: DAC0 only
+//	reaches the ADC through its own internal mux input, and the cell pins
+//	are wired to the pack through the dividers, so the per-pin mux offset
+//	cannot be measured this way. What the loopback covers (sampling
+//	capacitor, comparator, reference, accumulation) is common to every
+//	channel. The per-pin offset left over is constant, so it cancels in
+//	the loaded minus unloaded differences and in the slope the sweep fits
+//	for internal resistance. In the absolute cell voltages a millivolt or
+//	two at the pin is 5 to 10mV across a cell, against the 100mV steps of
+//	the health rating.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t failed: number of settings left uncorrected
+//
+//**************************************************************************
+uint8_t ADC_selftest_characterize(void)
+{
+	adc_channel_descriptor *loopback = &adc_channel_table[ADC_CH_DAC_LOOPBACK];
+	int32_t measured[ADC_CAL_POINTS];
+	uint8_t failed = 0;
+
+	/* ADC_code returns uncorrected codes while the tables are rebuilt */
+	for (uint8_t ref = 0; ref < ADC_REFERENCES; ref++)
+		for (uint8_t mode = 0; mode < 2; mode++)
+			for (uint8_t sampnum = 0; sampnum < ADC_SAMPNUM_SETTINGS; sampnum++)
+				adc_calibration_table[ref][mode][sampnum].valid = 0x00;
+
+	/* Output pin left disconnected */
+	DAC0.CTRLA = DAC_ENABLE_bm;
+
+	for (uint8_t ref = 0; ref < adc_reference_count; ref++)
+	{
+		uint16_t scale = adc_reference_table[ref].scale;
+
+		/* DAC0 on the reference the loopback is converted on */
+		VREF.DAC0REF = adc_reference_table[ref].refsel;
+		ADC_reference_pin(ADC_CH_DAC_LOOPBACK, ref);
+		_delay_us(ADC_REF_SETTLE_US);
+
+		for (uint8_t mode = 0; mode < 2; mode++)
+		{
+			for (uint8_t sampnum = 0; sampnum < ADC_SAMPNUM_SETTINGS; sampnum++)
+			{
+				adc_calibration *cal = &adc_calibration_table[ref][mode][sampnum];
+				uint8_t complete = 0x01;
+
+				loopback->mode = mode;
+				loopback->sampnum = sampnum;
+
+				/* DAC levels 1/8 ... 7/8 of the reference, the settling check waits for the DAC */
+				for (uint8_t k = 0; k < ADC_CAL_POINTS; k++)
+				{
+					DAC0.DATA = (uint16_t)((k + 1) * (ADC_CAL_STEP >> 6)) << 6;	// 10 bits, left adjusted
+					complete &= ADC_scan_read(adc_scan_dac_loopback, 1, &measured[k]);
+					measured[k] = (measured[k] * (int32_t)ADC_REF_SCALE_ONE + (scale >> 1)) / scale;	// back to codes of the reference
+				}
+
+				if (complete && ADC_selftest_fit(measured, cal))
+					cal->valid = 0x01;
+				else
+					failed++;
+			}
+		}
+	}
+
+	ADC_reference_pin(ADC_CH_DAC_LOOPBACK, adc_reference_count - 1);
+	DAC0.CTRLA = 0x00;
+	return failed;
+}
+//***************************************************************************
+//
+// Function Name : "ADC_calibrate_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Applies the loopback correction of one setting to a code: offset and
+//	gain first, then the nonlinearity interpolated between the points.
+//	The points are ADC_CAL_STEP apart, so the segment and the position in
+//	it come from shifts and masks, no search or division. Below the first
+//	and above the last point the end value is held.
+//
+// Inputs :
+//		const adc_calibration *cal: correction of the mode and accumulation
+//		int32_t code: decoded result in 1/65536 of VREF
+//
+// Outputs :
+//		int32_t code: corrected result in 1/65536 of VREF
+//
+//**************************************************************************
+int32_t ADC_calibrate_code(const adc_calibration *cal, int32_t code)
+{
+	/* |code| <= 2^17 and gain < 1.1 * 2^14, the product fits in 32 bits */
+	int32_t linear = ((code - cal->offset) * (int32_t)cal->gain) >> ADC_CAL_SHIFT;
+	int32_t position = linear - ADC_CAL_STEP;	// first point is at ADC_CAL_STEP
+	uint8_t segment;
+	int32_t fraction;
+
+	if (position <= 0)
+		return linear + cal->inl[0];
+	segment = (uint8_t)(position >> ADC_CAL_STEP_BITS);
+	if (segment >= ADC_CAL_POINTS - 1)
+		return linear + cal->inl[ADC_CAL_POINTS - 1];
+
+	fraction = position & (ADC_CAL_STEP - 1);
+	return linear + cal->inl[segment]
+		   + ((((int32_t)cal->inl[segment + 1] - cal->inl[segment]) * fraction) >> ADC_CAL_STEP_BITS);
+}
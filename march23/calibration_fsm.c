@@ -0,0 +1,97 @@
+#include "main.h"
+
+static uint16_t calibration_reference_a = 100;	// Reference current set by the user in Amps
+static uint8_t calibration_points;	// Points recorded in this calibration
+
+//***************************************************************************
+//
+// Function Name : "calibration_fsm"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Gain calibration finite state machine, entered by holding OK at power-up.
+//	The user sets a known load current with a reference meter and enters
+//	it with UP/DOWN in 10A steps. OK records the amplifier output versus
+//	gain at that current, repeated at as many levels as needed. BACK saves
+//	the table to EEPROM and returns to the main menu.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void calibration_fsm(void)
+{
+	uint8_t points;
+
+	switch (PB_PRESS)
+	{
+		/* UP pushbutton press -> raise reference current, cannot exceed 500A */
+		case UP:
+			if (calibration_reference_a < 500) {calibration_reference_a += 10;}
+			display_calibration_screen();
+			break;
+		/* DOWN pushbutton press -> lower reference current, cannot go below 10A */
+		case DOWN:
+			if (calibration_reference_a > 10) {calibration_reference_a -= 10;}
+			display_calibration_screen();
+			break;
+		/* OK pushbutton press -> record a point at the reference current */
+		case OK:
+			points = opamp_gain_calibration_record((int32_t)calibration_reference_a * 1000);
+			display_calibration_screen();
+			if (points == 0)
+				sprintf(dsp_buff[3], "Point rejected      ");
+			else
+			{
+				calibration_points = points;
+				sprintf(dsp_buff[3], "Recorded %u/%u       ", calibration_points, OPAMP_CAL_POINTS);
+			}
+			update_lcd();
+			break;
+		/* BACK pushbutton press -> save table and return to main menu */
+		case BACK:
+			clear_lcd();
+			if (opamp_gain_calibration_save())
+				sprintf(dsp_buff[0], "Gain cal saved      ");
+			else
+				sprintf(dsp_buff[0], "Gain cal not saved  ");
+			update_lcd();
+			_delay_ms(1500);
+
+			cursor = 1;
+			LOCAL_INTERFACE_CURRENT_STATE = MAIN_MENU_STATE;
+			display_main_menu();
+			break;
+		/* Default action is to start a new calibration and display the screen */
+		default:
+			opamp_gain_calibration_clear();
+			calibration_points = 0;
+			display_calibration_screen();
+			break;
+	}
+}
+
+//***************************************************************************
+//
+// Function Name : "display_calibration_screen"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//	Displays the reference current, the measured current with the table
+//	in use and the number of recorded points.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void display_calibration_screen(void)
+{
+	int32_t current_ma = load_current_Read();
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Gain Cal Ref: %uA", calibration_reference_a);
+	sprintf(dsp_buff[1], "Measured: %ldA", (long)(current_ma / 1000));
+	sprintf(dsp_buff[2], "Points: %u/%u", calibration_points, OPAMP_CAL_POINTS);
+	sprintf(dsp_buff[3], "OK:Record BACK:Save");
+	update_lcd();
+}
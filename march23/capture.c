@@ -0,0 +1,269 @@
+#include "main.h"
+
+/* Channels recorded in every capture frame, the trigger channel must be first */
+const uint8_t adc_scan_capture[CAPTURE_CHANNELS] = {ADC_CH_LOAD_CURRENT, PACK_CELLS(PACK_CELL_CHANNEL_ID)};
+
+/* Circular frame buffer, RAM use is CAPTURE_MAX_FRAMES * CAPTURE_CHANNELS * 2 bytes */
+static capture_frame capture_buffer[CAPTURE_MAX_FRAMES];
+
+/* Capture state, shared between the ADC RESRDY ISR and the consumers */
+static volatile CAPTURE_STATE capture_state;
+static volatile uint8_t capture_head;			// frame currently being written
+static volatile uint8_t capture_filled;			// complete frames in the buffer, up to capture_depth
+static volatile uint8_t capture_post_remaining;	// frames still to record after the trigger
+static volatile uint8_t capture_trigger_position;	// trigger frame, counted from the oldest frame
+static volatile int16_t capture_latest[CAPTURE_CHANNELS];	// newest value of every channel, for live display
+static const uint8_t *capture_kick;			// scan started when the capture completes, NULL for none
+static uint8_t capture_kick_length;
+static uint8_t capture_view_frame;			// frame shown by capture_view(), counted from the oldest frame
+static sample_filter capture_trigger_filter;	// recent current values, a single spike cannot trigger
+static int16_t capture_threshold;			// trigger level as code/2, compared with the filtered current
+
+//***************************************************************************
+//
+// Function Name : "capture_arm"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Starts an oscilloscope style capture of the load current and the cells.
+// The sample clock converts the capture channels round robin and every
+// complete frame goes into a circular buffer of capture_depth frames. Once
+// capture_pre_trigger frames are recorded the window comparator watches
+// the current channel, the frame where it crosses the threshold and the
+// filtered current confirms it is the trigger. The capture freezes after the remaining post-trigger frames and
+// the optional scan is started from the ADC interrupt right away.
+//
+// Inputs :
+//		int32_t threshold_code: trigger level of the current channel in 1/65536 of VREF
+//		const uint8_t *kick: scan sequence to start when the capture completes, NULL for none
+//		uint8_t kick_length: number of channels in the kick sequence
+//
+// Outputs : none
+//
+//**************************************************************************
+void capture_arm(int32_t threshold_code, const uint8_t *kick, uint8_t kick_length)
+{
+	uint16_t threshold;
+
+	if (capture_depth == 0 || capture_depth > CAPTURE_MAX_FRAMES)
+		capture_depth = CAPTURE_MAX_FRAMES;
+	if (capture_pre_trigger >= capture_depth)
+		capture_pre_trigger = capture_depth - 1;	// at least the trigger frame follows
+
+	capture_kick = kick;
+	capture_kick_length = kick_length;
+	capture_head = 0;
+	capture_filled = 0;
+	capture_post_remaining = capture_depth - capture_pre_trigger;
+	for (uint8_t i = 0; i < CAPTURE_CHANNELS; i++)
+		capture_latest[i] = 0;
+	sample_filter_init(&capture_trigger_filter, CAPTURE_TRIGGER_FILTER, CAPTURE_TRIGGER_WINDOW);
+	capture_threshold = (int16_t)(threshold_code >> 1);
+
+	ADC_scan_wait();	// let any background scan finish first
+
+	threshold = ADC_code_to_raw(adc_scan_capture[0], threshold_code);
+
+	/* Window comparator flags every result above the threshold, only current results are looked at */
+	ADC0.WINHT = threshold;
+	ADC0.CTRLE = ADC_WINCM_ABOVE_gc;
+	ADC0.INTFLAGS = ADC_WCMP_bm;
+
+	capture_state = CAPTURE_FILLING;
+	ADC_clocked_start(adc_scan_capture, CAPTURE_CHANNELS, capture_rate_hz);
+}
+//***************************************************************************
+//
+// Function Name : "capture_abort"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Stops a capture that is still running, or forgets a finished one, so
+// capture_view() no longer shows it. The frames recorded so far are
+// discarded.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void capture_abort(void)
+{
+	if (capture_state == CAPTURE_FILLING || capture_state == CAPTURE_TRIGGERED)
+	{
+		ADC_clocked_stop();
+		ADC0.CTRLE = ADC_WINCM_NONE_gc;
+	}
+	capture_state = CAPTURE_IDLE;
+}
+//***************************************************************************
+//
+// Function Name : "capture_store"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Called from the ADC RESRDY interrupt for every sample clock result while
+// a capture runs. Stores the value in the current frame, checks the
+// window comparator flag on the trigger channel and freezes the buffer
+// after the last post-trigger frame. Values are kept as code/2 in an
+// int16_t, which holds single-ended and differential codes at 15 bits.
+//
+// Inputs :
+//		uint8_t index: position of the result in adc_scan_capture
+//		adc_result result: the conversion result
+//
+// Outputs : none
+//
+//**************************************************************************
+void capture_store(uint8_t index, adc_result result)
+{
+	uint8_t above = ADC0.INTFLAGS & ADC_WCMP_bm;	// set together with RESRDY for this result
+	int32_t code = ADC_code(result) >> 1;
+	int16_t value = (code > INT16_MAX) ? INT16_MAX : (int16_t)code;	// the gain correction can exceed 15 bits
+
+	ADC0.INTFLAGS = ADC_WCMP_bm;
+	capture_buffer[capture_head].value[index] = value;
+	capture_latest[index] = value;
+
+	/* Trigger on the current channel once enough history is recorded. The comparator
+	   flag gates the filter, which only has to sort its window for samples above the level */
+	if (index == 0)
+	{
+		sample_filter_push(&capture_trigger_filter, value);
+		if (above && capture_state == CAPTURE_FILLING && capture_filled >= capture_pre_trigger
+			&& sample_filter_median(&capture_trigger_filter) >= capture_threshold)
+			capture_state = CAPTURE_TRIGGERED;
+	}
+
+	if (index != CAPTURE_CHANNELS - 1)
+		return;
+
+	/* Frame complete: advance, the oldest frame is overwritten once the buffer is full */
+	if (capture_filled < capture_depth)
+		capture_filled++;
+	capture_head = (capture_head + 1 < capture_depth) ? capture_head + 1 : 0;
+
+	if (capture_state == CAPTURE_TRIGGERED && --capture_post_remaining == 0)
+	{
+		ADC_clocked_stop();
+		ADC0.CTRLE = ADC_WINCM_NONE_gc;
+		capture_trigger_position = capture_filled - (capture_depth - capture_pre_trigger);
+		capture_view_frame = capture_trigger_position;
+		capture_state = CAPTURE_DONE;
+
+		if (capture_kick != NULL)
+		{
+			ADC_ring_flush();
+			ADC_scan_start(capture_kick, capture_kick_length);
+		}
+	}
+}
+//***************************************************************************
+//
+// Function Name : "capture_isRunning"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Reports whether sample clock results belong to a capture.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t running: 0x01 while filling or after the trigger, 0x00 otherwise
+//
+//**************************************************************************
+uint8_t capture_isRunning(void)
+{
+	return (capture_state == CAPTURE_FILLING || capture_state == CAPTURE_TRIGGERED);
+}
+//***************************************************************************
+//
+// Function Name : "capture_isDone"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Reports whether a capture has triggered and frozen its buffer.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t done: 0x01 once the last post-trigger frame is recorded
+//
+//**************************************************************************
+uint8_t capture_isDone(void)
+{
+	return (capture_state == CAPTURE_DONE);
+}
+//***************************************************************************
+//
+// Function Name : "capture_latest_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Newest value of one capture channel, for a live display while the
+// capture runs.
+//
+// Inputs :
+//		uint8_t index: position of the channel in adc_scan_capture
+//
+// Outputs :
+//		int32_t code: result in 1/65536 of VREF
+//
+//**************************************************************************
+int32_t capture_latest_code(uint8_t index)
+{
+	return (int32_t)capture_latest[index] * 2;
+}
+//***************************************************************************
+//
+// Function Name : "capture_view"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Shows one frame of the frozen capture on the LCD: time relative to the
+// trigger, load current and the cell voltages, 2 per line with labels or
+// 3 per line without them for packs of more than 4 cells. UP and DOWN step
+// through the frames, the view starts at the trigger frame.
+//
+// Inputs :
+//		PB_INPUT_TYPE pb_type: Pushbutton press identifier
+//
+// Outputs : none
+//
+//**************************************************************************
+void capture_view(PB_INPUT_TYPE pb_type)
+{
+	uint8_t oldest = (capture_head + capture_depth - capture_filled) % capture_depth;
+	const capture_frame *frame;
+	int32_t time_ms, current_ma;
+	uint16_t cell_mv[PACK_CELL_COUNT];
+	const uint8_t cells_per_line = (PACK_CELL_COUNT > 4) ? 3 : 2;
+
+	clear_lcd();
+	if (capture_state != CAPTURE_DONE)
+	{
+		sprintf(dsp_buff[0], "No capture recorded");
+		update_lcd();
+		return;
+	}
+
+	/* UP moves back in time, DOWN forward */
+	if (pb_type == UP && capture_view_frame > 0)
+		capture_view_frame--;
+	else if (pb_type == DOWN && capture_view_frame < capture_filled - 1)
+		capture_view_frame++;
+
+	frame = &capture_buffer[(oldest + capture_view_frame) % capture_depth];
+	current_ma = load_current_from_code((int32_t)frame->value[0] * 2);
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		cell_mv[i] = (uint16_t)fixed_point_apply(&cell_scale_mv, (int32_t)frame->value[i + 1] * 2);
+
+	/* One frame lasts CAPTURE_CHANNELS sample clock periods */
+	time_ms = ((int32_t)capture_view_frame - capture_trigger_position) * sample_clock_period * CAPTURE_CHANNELS * 1000 / (int32_t)RTC_CLOCK_HZ;
+
+	sprintf(dsp_buff[0], "t=%ldms I=%ldA", (long)time_ms, (long)(current_ma / 1000));
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+	{
+		char *line = dsp_buff[1 + i / cells_per_line] + (i % cells_per_line) * ((cells_per_line == 2) ? 9 : 6);
+		if (cells_per_line == 2)
+			sprintf(line, "B%u %u.%03u ", i + 1, cell_mv[i] / 1000, cell_mv[i] % 1000);
+		else
+			sprintf(line, "%u.%03u ", cell_mv[i] / 1000, cell_mv[i] % 1000);
+	}
+	sprintf(dsp_buff[3], "Frame %u/%u%s", capture_view_frame + 1, capture_filled,
+			(capture_view_frame == capture_trigger_position) ? " TRIG" : "");
+	update_lcd();
+}
@@ -0,0 +1,147 @@
+#include "main.h"
+
+//***************************************************************************
+//
+// Function Name : "sample_filter_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Empties a streaming filter and selects its type and window length. The
+// window is kept odd so the median is always one of the samples.
+//
+// Inputs :
+//		sample_filter *filter: filter to set up
+//		FILTER_TYPE type: FILTER_MEDIAN or FILTER_HAMPEL
+//		uint8_t length: window length, clamped to 1..FILTER_MAX_WINDOW
+//
+// Outputs : none
+//
+//**************************************************************************
+void sample_filter_init(sample_filter *filter, FILTER_TYPE type, uint8_t length)
+{
+	if (length == 0)
+		length = 1;
+	if (length > FILTER_MAX_WINDOW)
+		length = FILTER_MAX_WINDOW;
+
+	filter->type = type;
+	filter->length = length | 0x01;
+	filter->head = 0;
+	filter->count = 0;
+}
+//***************************************************************************
+//
+// Function Name : "sample_filter_push"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Adds a sample to the window, the oldest sample is overwritten once the
+// window is full. Constant time, cheap enough for the ADC interrupt.
+//
+// Inputs :
+//		sample_filter *filter: streaming filter
+//		int32_t sample: new sample
+//
+// Outputs : none
+//
+//**************************************************************************
+void sample_filter_push(sample_filter *filter, int32_t sample)
+{
+	filter->window[filter->head] = sample;
+	filter->head = (filter->head + 1 < filter->length) ? filter->head + 1 : 0;
+	if (filter->count < filter->length)
+		filter->count++;
+}
+//***************************************************************************
+//
+// Function Name : "sample_filter_select_median"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Median of a small array by insertion sort of a copy. With the window
+// limited to FILTER_MAX_WINDOW the worst case is a fixed number of
+// compares, so the cost per sample is bounded.
+//
+// Inputs :
+//		const int32_t *values: samples
+//		uint8_t count: number of samples, at least 1
+//
+// Outputs :
+//		int32_t median: middle value, the upper one for an even count
+//
+//**************************************************************************
+static int32_t sample_filter_select_median(const int32_t *values, uint8_t count)
+{
+	int32_t sorted[FILTER_MAX_WINDOW];
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		int32_t value = values[i];
+		uint8_t j = i;
+
+		while (j > 0 && sorted[j - 1] > value)
+		{
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+		sorted[j] = value;
+	}
+	return sorted[count / 2];
+}
+//***************************************************************************
+//
+// Function Name : "sample_filter_median"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Median of the samples currently in the window.
+//
+// Inputs :
+//		const sample_filter *filter: streaming filter
+//
+// Outputs :
+//		int32_t median: 0 while the window is empty
+//
+//**************************************************************************
+int32_t sample_filter_median(const sample_filter *filter)
+{
+	if (filter->count == 0)
+		return 0;
+	return sample_filter_select_median(filter->window, filter->count);
+}
+//***************************************************************************
+//
+// Function Name : "sample_filter_apply"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Pushes a sample and returns the filter output.
+//	FILTER_MEDIAN: the median of the window, a spike shorter than half the
+//		window never reaches the output.
+//	FILTER_HAMPEL: the sample itself unless it is further from the window
+//		median than FILTER_HAMPEL_K_Q4 / 16 times the median absolute
+//		deviation, then the median replaces it. Clean samples pass without
+//		delay, only outliers are held back.
+//
+// Inputs :
+//		sample_filter *filter: streaming filter
+//		int32_t sample: new sample
+//
+// Outputs :
+//		int32_t filtered: filter output for this sample
+//
+//**************************************************************************
+int32_t sample_filter_apply(sample_filter *filter, int32_t sample)
+{
+	int32_t deviation[FILTER_MAX_WINDOW];
+	int32_t median, mad;
+
+	sample_filter_push(filter, sample);
+	median = sample_filter_select_median(filter->window, filter->count);
+	if (filter->type == FILTER_MEDIAN)
+		return median;
+
+	/* Median absolute deviation, a noise estimate that the outlier itself cannot inflate */
+	for (uint8_t i = 0; i < filter->count; i++)
+		deviation[i] = labs(filter->window[i] - median);
+	mad = sample_filter_select_median(deviation, filter->count);
+
+	if (labs(sample - median) * 16 > mad * FILTER_HAMPEL_K_Q4)
+		return median;
+	return sample;
+}
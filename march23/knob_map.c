@@ -0,0 +1,340 @@
+#include "main.h"
+
+knob_map knob_map_active;
+
+//***************************************************************************
+//
+// Function Name : "knob_map_conductance"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Load current per volt of pack, the quantity the map stores. The pile
+//	is close to a resistor, so a map recorded on one pack predicts the
+//	current on another from its voltage.
+//
+// Inputs :
+//		int32_t current_ma: load current
+//		int32_t pack_mv: unloaded pack voltage, at least CELL_MIN_MV
+//
+// Outputs :
+//		uint16_t conductance: 1/256 A/V
+//
+//**************************************************************************
+static uint16_t knob_map_conductance(int32_t current_ma, int32_t pack_mv)
+{
+	int32_t conductance;
+
+	if (current_ma <= 0)
+		return 0;
+	conductance = (current_ma * 256) / pack_mv;
+	return (conductance > 0xFFFF) ? 0xFFFF : (uint16_t)conductance;
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_save"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Stores the map in use in EEPROM with magic number and checksum. Only
+//	the bytes that changed are written, a refinement after a test costs a
+//	few cells of EEPROM endurance.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void knob_map_save(void)
+{
+	knob_map_active.magic = KNOB_MAP_MAGIC;
+	knob_map_active.checksum = eeprom_block_checksum(&knob_map_active, sizeof(knob_map) - 1);
+	eeprom_update_block(&knob_map_active, &knob_map_eeprom, sizeof(knob_map));
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_load"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Reads the knob map from EEPROM and checks it before it is used: magic
+//	number, checksum, a point spacing and conductances that never fall
+//	with the knob turned further and reach some current at the end. An
+//	invalid map is ignored and set_load_current() searches with the
+//	controller alone. Called once at boot.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t valid: 0x01 if the map is used
+//
+//**************************************************************************
+uint8_t knob_map_load(void)
+{
+	uint8_t valid;
+
+	eeprom_read_block(&knob_map_active, &knob_map_eeprom, sizeof(knob_map));
+
+	valid = (knob_map_active.magic == KNOB_MAP_MAGIC)
+			&& (eeprom_block_checksum(&knob_map_active, sizeof(knob_map) - 1) == knob_map_active.checksum)
+			&& (knob_map_active.spacing > 0)
+			&& (knob_map_active.conductance[KNOB_MAP_POINTS - 1] > 0);
+
+	for (uint8_t k = 1; valid && k < KNOB_MAP_POINTS; k++)
+	{
+		if (knob_map_active.conductance[k] < knob_map_active.conductance[k - 1])
+			valid = 0x00;
+	}
+
+	if (!valid)
+		knob_map_active.spacing = 0;	// no feedforward
+	return valid;
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_position"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Knob position the map expects to draw a current from a pack. The first
+//	segment reaching the conductance is interpolated linearly, the dead
+//	travel before the pile closes maps to the end of the flat segments.
+//	Past the end of the map the last point is returned, the controller
+//	finds the rest.
+//
+// Inputs :
+//		int32_t current_ma: load current wanted
+//		int32_t pack_mv: unloaded pack voltage
+//
+// Outputs :
+//		int32_t position: steps from open circuit, -1 without a valid map or a homed knob
+//
+//**************************************************************************
+int32_t knob_map_position(int32_t current_ma, int32_t pack_mv)
+{
+	const uint16_t *conductance = knob_map_active.conductance;
+	uint16_t spacing = knob_map_active.spacing;
+	uint16_t wanted;
+
+	if (spacing == 0 || !stepper_isHomed() || pack_mv < CELL_MIN_MV)
+		return -1;
+
+	wanted = knob_map_conductance(current_ma, pack_mv);
+	for (uint8_t k = 1; k < KNOB_MAP_POINTS; k++)
+	{
+		if (conductance[k] >= wanted && conductance[k] > conductance[k - 1])
+		{
+			uint32_t rise = conductance[k] - conductance[k - 1];
+			uint32_t part = (wanted > conductance[k - 1]) ? wanted - conductance[k - 1] : 0;
+			return (int32_t)(k - 1) * spacing + (int32_t)(part * spacing / rise);
+		}
+	}
+	return (int32_t)(KNOB_MAP_POINTS - 1) * spacing;
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_learn"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Refines the map with a settled reading, so it follows a warm pile and
+//	wear of the carbon discs from test to test. The prediction error at
+//	the position is shared by the two neighbouring points in proportion
+//	to their closeness, the least-mean-squares step of a piecewise linear
+//	map, scaled down by KNOB_MAP_LEARN_SHIFT. Points pushed out of order
+//	are levelled with their neighbours, and the map is saved.
+//
+// Inputs :
+//		int32_t position: knob position of the reading, steps from open circuit
+//		int32_t current_ma: settled load current
+//		int32_t pack_mv: unloaded pack voltage
+//
+// Outputs : none
+//
+//**************************************************************************
+void knob_map_learn(int32_t position, int32_t current_ma, int32_t pack_mv)
+{
+	uint16_t *conductance = knob_map_active.conductance;
+	uint16_t spacing = knob_map_active.spacing;
+	int32_t predicted, error, low, high;
+	uint16_t offset;
+	uint8_t k;
+
+	if (spacing == 0 || !stepper_isHomed() || pack_mv < CELL_MIN_MV
+		|| position < 0 || position >= (int32_t)(KNOB_MAP_POINTS - 1) * spacing)
+		return;
+
+	k = (uint8_t)(position / spacing);
+	offset = (uint16_t)(position % spacing);
+	predicted = conductance[k] + ((int32_t)conductance[k + 1] - conductance[k]) * offset / spacing;
+	error = (int32_t)knob_map_conductance(current_ma, pack_mv) - predicted;
+
+	low = conductance[k] + ((error * (spacing - offset) / spacing) >> KNOB_MAP_LEARN_SHIFT);
+	high = conductance[k + 1] + ((error * offset / spacing) >> KNOB_MAP_LEARN_SHIFT);
+	conductance[k] = (low < 0) ? 0 : ((low > 0xFFFF) ? 0xFFFF : (uint16_t)low);
+	conductance[k + 1] = (high < 0) ? 0 : ((high > 0xFFFF) ? 0xFFFF : (uint16_t)high);
+
+	for (uint8_t i = k + 1; i > 0; i--)
+	{
+		if (conductance[i - 1] > conductance[i])
+			conductance[i - 1] = conductance[i];
+	}
+	for (uint8_t i = k; i + 1 < KNOB_MAP_POINTS; i++)
+	{
+		if (conductance[i + 1] < conductance[i])
+			conductance[i + 1] = conductance[i];
+	}
+
+	knob_map_active.updates++;
+	knob_map_save();
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_characterize"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Records a new knob map. The knob is homed afresh by open_circuit_load(),
+//	then turned clockwise KNOB_MAP_SWEEP_STEP steps at a time and the
+//	median current of a few readings taken at rest after every move, until
+//	the load draws max_current_ma or KNOB_MAP_SWEEP_SAMPLES readings are
+//	taken. The load is opened again and the sweep is resampled onto
+//	KNOB_MAP_POINTS evenly spaced positions covering it, nothing is saved
+//	if the load does not open. The fan has to run, the sweep loads the
+//	pack like a test.
+//
+// Inputs :
+//		int32_t max_current_ma: current the sweep stops at
+//		int32_t pack_mv: unloaded pack voltage
+//
+// Outputs :
+//		uint8_t valid: 0x01 if the new map is saved and in use, 0x00 without a pack, load current or open load
+//
+//**************************************************************************
+uint8_t knob_map_characterize(int32_t max_current_ma, int32_t pack_mv)
+{
+	uint16_t sweep[KNOB_MAP_SWEEP_SAMPLES];
+	sample_filter filter;
+	int32_t current_ma = 0;
+	uint8_t count = 0;
+	uint16_t spacing;
+
+	if (pack_mv < CELL_MIN_MV)
+		return 0x00;
+
+	stepper_home_lost();	// a new map starts from a fresh home
+	if (!open_circuit_load())
+		return 0x00;
+	while (count < KNOB_MAP_SWEEP_SAMPLES)
+	{
+		sample_filter_init(&filter, FILTER_MEDIAN, LOAD_CONTROL_WINDOW);
+		for (uint8_t i = 0; i < LOAD_CONTROL_WINDOW; i++)
+			current_ma = sample_filter_apply(&filter, load_current_Read());
+		sweep[count++] = knob_map_conductance(current_ma, pack_mv);
+		if (current_ma >= max_current_ma)
+			break;
+
+		stepper_move(KNOB_MAP_SWEEP_STEP, KNOB_MAP_SWEEP_RATE_HZ);
+		while (stepper_isBusy());
+	}
+	if (!open_circuit_load() || count < 2 || sweep[count - 1] == 0)
+		return 0x00;
+
+	/* Resample, the last point lands on or just before the last reading */
+	spacing = (uint16_t)((uint32_t)(count - 1) * KNOB_MAP_SWEEP_STEP / (KNOB_MAP_POINTS - 1));
+	for (uint8_t k = 0; k < KNOB_MAP_POINTS; k++)
+	{
+		uint32_t position = (uint32_t)k * spacing;
+		uint8_t i = (uint8_t)(position / KNOB_MAP_SWEEP_STEP);
+		uint16_t offset = (uint16_t)(position % KNOB_MAP_SWEEP_STEP);
+		int32_t value = sweep[i];
+
+		if (offset != 0)
+			value += ((int32_t)sweep[i + 1] - sweep[i]) * offset / KNOB_MAP_SWEEP_STEP;
+		if (k > 0 && value < knob_map_active.conductance[k - 1])
+			value = knob_map_active.conductance[k - 1];	// reading noise, the pile only closes further
+		knob_map_active.conductance[k] = (uint16_t)value;
+	}
+	knob_map_active.spacing = spacing;
+	knob_map_active.updates = 0;
+	knob_map_save();
+	return knob_map_load();
+}
+//***************************************************************************
+//
+// Function Name : "knob_map_view"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Entered by holding UP at power-up with a pack connected. The balance
+// lead has to pass tap_diagnostics_run() first, a failure is shown until
+// OK or BACK is pressed and nothing is loaded. Otherwise the operator
+// confirms the sweep with OK, BACK cancels it. The knob is then swept
+// up to KNOB_MAP_SWEEP_MAX_MA for a new map and the mapped travel and
+// the current at its end are shown until OK is pressed. Runs with
+// interrupts enabled for the step timer, so the presses it polls are
+// discarded on the way out and the main menu is shown again.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void knob_map_view(void)
+{
+	uint8_t confirmed, valid;
+
+	while (!(PORTA.IN & PIN4_bm));	// UP released
+
+	/* Same pre-test check as a test, a pack that fails it is not loaded */
+	if (tap_diagnostics_run(&last_tap_diagnosis) != TAP_FAULT_NONE)
+	{
+		tap_diagnostics_display(&last_tap_diagnosis);
+		while ((PORTA.IN & PIN2_bm) && (PORTA.IN & PIN3_bm));	// OK or BACK pressed
+		while (!(PORTA.IN & PIN2_bm) || !(PORTA.IN & PIN3_bm));	// released
+		PB_PRESS = NONE;
+		display_main_menu();
+		return;
+	}
+	pack_voltage_mv = last_tap_diagnosis.measured_mv;
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Knob sweep to %3ldA  ", (long)(KNOB_MAP_SWEEP_MAX_MA / 1000));
+	sprintf(dsp_buff[1], "Pack %2ld.%02ldV         ", (long)(pack_voltage_mv / 1000), (long)((pack_voltage_mv % 1000) / 10));
+	sprintf(dsp_buff[2], "OK: start sweep     ");
+	sprintf(dsp_buff[3], "BACK: cancel        ");
+	update_lcd();
+
+	while ((PORTA.IN & PIN2_bm) && (PORTA.IN & PIN3_bm));	// OK or BACK pressed
+	confirmed = !(PORTA.IN & PIN2_bm);
+	while (!(PORTA.IN & PIN2_bm) || !(PORTA.IN & PIN3_bm));	// released
+	if (!confirmed)
+	{
+		PB_PRESS = NONE;
+		display_main_menu();
+		return;
+	}
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Knob sweep...       ");
+	sprintf(dsp_buff[1], "Pack %2ld.%02ldV         ", (long)(pack_voltage_mv / 1000), (long)((pack_voltage_mv % 1000) / 10));
+	update_lcd();
+
+	set_Fan_PWM(75);
+	valid = knob_map_characterize(KNOB_MAP_SWEEP_MAX_MA, pack_voltage_mv);
+	set_Fan_PWM(0);
+
+	clear_lcd();
+	if (valid)
+	{
+		int32_t end_ma = (int32_t)knob_map_active.conductance[KNOB_MAP_POINTS - 1] * pack_voltage_mv / 256;
+
+		sprintf(dsp_buff[0], "Knob map saved      ");
+		sprintf(dsp_buff[1], "Travel %5u steps  ", knob_map_active.spacing * (KNOB_MAP_POINTS - 1));
+		sprintf(dsp_buff[2], "End load %4ld.%ldA   ", (long)(end_ma / 1000), (long)((end_ma % 1000) / 100));
+	}
+	else
+	{
+		sprintf(dsp_buff[0], "Knob sweep failed   ");
+		sprintf(dsp_buff[1], "No pack or no load  ");
+	}
+	sprintf(dsp_buff[3], "OK to continue      ");
+	update_lcd();
+
+	while (PORTA.IN & PIN2_bm);		// OK pressed
+	while (!(PORTA.IN & PIN2_bm));	// OK released
+	PB_PRESS = NONE;
+	display_main_menu();
+}
@@ -0,0 +1,203 @@
+#include "main.h"
+
+//***************************************************************************
+//
+// Function Name : "load_sweep_plan"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Currents of a sweep up to max_current_ma: every entry of
+//	load_sweep_currents_a below it in the order listed, then max_current_ma
+//	itself, so the sweep always ends at the current setting of the test.
+//
+// Inputs :
+//		int32_t max_current_ma: last and largest current of the sweep
+//		int32_t *plan_ma: receives up to LOAD_SWEEP_MAX_STEPS currents
+//
+// Outputs :
+//		uint8_t steps: currents in plan_ma
+//
+//**************************************************************************
+static uint8_t load_sweep_plan(int32_t max_current_ma, int32_t *plan_ma)
+{
+	uint8_t steps = 0;
+
+	for (uint8_t k = 0; k < load_sweep_steps && k < LOAD_SWEEP_MAX_STEPS && steps < LOAD_SWEEP_MAX_STEPS - 1; k++)
+	{
+		int32_t step_ma = (int32_t)load_sweep_currents_a[k] * 1000;
+		if (step_ma > 0 && step_ma < max_current_ma)
+			plan_ma[steps++] = step_ma;
+	}
+	plan_ma[steps++] = max_current_ma;
+	return steps;
+}
+//***************************************************************************
+//
+// Function Name : "load_sweep_fit"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Least squares line V = V0 - R * I through the steady steps of the
+//	sweep, per cell. The sums are taken about the mean current and
+//	voltage, so they stay in 64 bits and the slope keeps its precision:
+//	R = -Sxy / Sxx, in mV/mA scaled by 10^6 to micro-ohms. V0 is the
+//	open circuit voltage the line points to, and the largest distance of
+//	a step from the line shows how far the cell is from a plain resistor.
+//	Needs two steps at different currents, the fit is left empty otherwise.
+//
+// Inputs :
+//		load_sweep_report *report: steps of the sweep, receives the fit
+//
+// Outputs : none
+//
+//**************************************************************************
+static void load_sweep_fit(load_sweep_report *report)
+{
+	int32_t sum_ma = 0, mean_ma;
+	int64_t sxx = 0;
+	uint8_t n = 0;
+
+	for (uint8_t k = 0; k < report->steps; k++)
+		if (report->steady_mask & (1 << k))
+		{
+			sum_ma += report->current_ma[k];
+			n++;
+		}
+	report->fit_points = 0;
+	if (n < 2)
+		return;
+
+	mean_ma = sum_ma / n;
+	for (uint8_t k = 0; k < report->steps; k++)
+		if (report->steady_mask & (1 << k))
+			sxx += (int64_t)(report->current_ma[k] - mean_ma) * (report->current_ma[k] - mean_ma);
+	if (sxx == 0)
+		return;	// every step drew the same current, no slope
+
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+	{
+		int32_t sum_mv = 0, mean_mv, v0_mv;
+		int64_t sxy = 0, r_uohm;
+		uint16_t residual_mv = 0;
+
+		for (uint8_t k = 0; k < report->steps; k++)
+			if (report->steady_mask & (1 << k))
+				sum_mv += report->cell_mv[k][i];
+		mean_mv = sum_mv / n;
+		for (uint8_t k = 0; k < report->steps; k++)
+			if (report->steady_mask & (1 << k))
+				sxy += (int64_t)(report->current_ma[k] - mean_ma) * ((int32_t)report->cell_mv[k][i] - mean_mv);
+
+		/* Rounded to the nearest micro-ohm, the voltage falls as the current rises */
+		r_uohm = -sxy * 1000000;
+		r_uohm = (r_uohm >= 0) ? (r_uohm + sxx / 2) / sxx : (r_uohm - sxx / 2) / sxx;
+		v0_mv = mean_mv + (int32_t)((r_uohm * mean_ma + 500000) / 1000000);
+
+		for (uint8_t k = 0; k < report->steps; k++)
+			if (report->steady_mask & (1 << k))
+			{
+				int32_t line_mv = v0_mv - (int32_t)((r_uohm * report->current_ma[k] + 500000) / 1000000);
+				int32_t off_mv = labs(line_mv - (int32_t)report->cell_mv[k][i]);
+				if (off_mv > residual_mv)
+					residual_mv = (off_mv > 0xFFFF) ? 0xFFFF : (uint16_t)off_mv;
+			}
+
+		report->resistance_uohm[i] = (int32_t)r_uohm;
+		report->ocv_mv[i] = (v0_mv < 0) ? 0 : (v0_mv > 0xFFFF) ? 0xFFFF : (uint16_t)v0_mv;
+		report->residual_mv[i] = residual_mv;
+	}
+	report->fit_points = n;
+}
+//***************************************************************************
+//
+// Function Name : "load_sweep_run"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Multi-step loaded test for the DC internal resistance of every cell.
+//	Steps up through the currents of load_sweep_plan(), set_load_current()
+//	brings the load to each and load_hold() keeps it there for
+//	LOAD_SWEEP_HOLD_MS. The mean cell voltages and current of the end of
+//	the hold are one point of the sweep, measured at a current that did not
+//	move, so voltages and current belong together. A step whose hold was
+//	not steady or whose cells were noisy is kept but left out of the fit.
+//	The load stays applied at the last step, max_current_ma, and
+//	loaded_cell_stats and loaded_current_stats hold its readings like after
+//	a single point test.
+//
+// Inputs :
+//		int32_t max_current_ma: current setting of the test, the last step
+//
+// Outputs :
+//		uint8_t steady: 0x01 if the hold of the last step was steady
+//
+//**************************************************************************
+uint8_t load_sweep_run(int32_t max_current_ma)
+{
+	load_sweep_report *report = &last_load_sweep;
+	int32_t plan_ma[LOAD_SWEEP_MAX_STEPS];
+	uint8_t steady = 0x00;
+
+	report->steps = load_sweep_plan(max_current_ma, plan_ma);
+	report->steady_mask = 0;
+
+	for (uint8_t k = 0; k < report->steps; k++)
+	{
+		sprintf(dsp_buff[1], "Sweep %u/%u: %3luA    ", k + 1, report->steps, (unsigned long)(plan_ma[k] / 1000));
+		update_lcd();
+		set_load_current(plan_ma[k]);
+		steady = load_hold(plan_ma[k], LOAD_SWEEP_HOLD_MS);
+
+		report->current_ma[k] = measurement_stats_mean(&loaded_current_stats);
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		{
+			report->cell_mv[k][i] = (uint16_t)measurement_stats_mean(&loaded_cell_stats[i]);
+			if (measurement_stats_quality(&loaded_cell_stats[i], LOADED_MAX_STDDEV_MV, CELL_MIN_MV, CELL_MAX_MV) != MEASUREMENT_OK)
+				steady = 0x00;
+		}
+		if (steady)
+			report->steady_mask |= (1 << k);
+	}
+
+	load_sweep_fit(report);
+	return steady;
+}
+//***************************************************************************
+//
+// Function Name : "load_sweep_view"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Shows the DC internal resistance fitted by the last sweep in milliohms
+//	and the open circuit voltage of the fit, one line per cell from
+//	cell_page. A '*' in place of the space before the voltage marks a cell
+//	that strays more than LOAD_SWEEP_RESIDUAL_MV from its line. A
+//	resistance or voltage that does not fit the 20 character line, which a
+//	collapsing cell easily gives, shows as no fit.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void load_sweep_view(void)
+{
+	const load_sweep_report *report = &last_load_sweep;
+
+	clear_lcd();
+	if (report->fit_points < 2)
+	{
+		sprintf(dsp_buff[0], "No sweep recorded   ");
+		update_lcd();
+		return;
+	}
+
+	for (uint8_t line = 0; line < LCD_LINES && cell_page + line < PACK_CELL_COUNT; line++)
+	{
+		uint8_t i = cell_page + line;
+		int32_t r_uohm = report->resistance_uohm[i];
+
+		if (r_uohm < 0 || r_uohm > 99999 || report->ocv_mv[i] > 9999)
+			sprintf(dsp_buff[line], "B%u: no fit         ", i + 1);
+		else
+			sprintf(dsp_buff[line], "B%u %2ld.%03ldmOhm%c%u.%03uV", i + 1, (long)(r_uohm / 1000), (long)(r_uohm % 1000),
+					(report->residual_mv[i] > LOAD_SWEEP_RESIDUAL_MV) ? '*' : ' ', report->ocv_mv[i] / 1000, report->ocv_mv[i] % 1000);
+	}
+	update_lcd();
+}
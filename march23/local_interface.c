@@ -43,9 +43,9 @@ ISR(PORTA_PORT_vect)
 //**************************************************************************
 void OK_ISR (void)
 {
-	/* Set pushbutton type to OK and enter local interface fsm */
-	PB_PRESS = OK;
-	LOCAL_INTERFACE_FSM();
+	/* Set pushbutton type to OK, main loop enters local interface fsm */
+	if (PB_PRESS == NONE)	// presses while the last one is handled are dropped
+		PB_PRESS = OK;
 	return;
 }
 //***************************************************************************
@@ -62,9 +62,9 @@ void OK_ISR (void)
 //**************************************************************************
 void BACK_ISR (void)
 {
-	/* Set pushbutton type to BACK and enter local interface fsm */
-	PB_PRESS = BACK;
-	LOCAL_INTERFACE_FSM();
+	/* Set pushbutton type to BACK, main loop enters local interface fsm */
+	if (PB_PRESS == NONE)	// presses while the last one is handled are dropped
+		PB_PRESS = BACK;
 	return;
 }
 //***************************************************************************
@@ -81,9 +81,9 @@ void BACK_ISR (void)
 //**************************************************************************
 void UP_ISR (void)
 {
-	/* Set pushbutton type to UP and enter local interface fsm */
-	PB_PRESS = UP;
-	LOCAL_INTERFACE_FSM();
+	/* Set pushbutton type to UP, main loop enters local interface fsm */
+	if (PB_PRESS == NONE)	// presses while the last one is handled are dropped
+		PB_PRESS = UP;
 	return;
 }
 //***************************************************************************
@@ -100,9 +100,9 @@ void UP_ISR (void)
 //**************************************************************************
 void DOWN_ISR (void)
 {
-	/* Set pushbutton type to DOWN and enter local interface fsm */
-	PB_PRESS = DOWN;
-	LOCAL_INTERFACE_FSM();
+	/* Set pushbutton type to DOWN, main loop enters local interface fsm */
+	if (PB_PRESS == NONE)	// presses while the last one is handled are dropped
+		PB_PRESS = DOWN;
 	return;
 }
 //***************************************************************************
@@ -111,7 +111,9 @@ void DOWN_ISR (void)
 // Target MCU : AVR128DB48
 // DESCRIPTION
 // Top level Finite State Machine controller. This is the first function that 
-//  is called after a pushbutton is pressed. Based on the current state of 
+//  is called by the main loop after a pushbutton is pressed. It runs with
+//  interrupts enabled so the ADC and timer interrupts keep working during
+//  a test. Based on the current state of 
 //  the local interface it will call either the main menu fsm, the test 
 //  fsm, the view history fsm, or the settings fsm. 
 //
@@ -136,6 +138,10 @@ void LOCAL_INTERFACE_FSM(void)
 		case VIEW_HISTORY_STATE:
 			view_history_fsm();	
 			break;
+		/* Calibration fsm handles pushbutton press */
+		case CALIBRATION_STATE:
+			calibration_fsm();
+			break;
 		/* Settings fsm handles pushbutton press */
 		case SETTINGS_STATE:
 			settings_fsm();
@@ -146,8 +152,8 @@ void LOCAL_INTERFACE_FSM(void)
 			break;
 	}
 	
-	PB_PRESS = NONE;	// Clear pushbutton state after it is handled
 	_delay_ms(200);		// Software debounce
+	PB_PRESS = NONE;	// Clear pushbutton state after it is handled, accepts the next press
 	return;
 }
 
@@ -172,7 +178,7 @@ void discard_test_results(PB_INPUT_TYPE pb_type)
 	if (pb_type == OK)
 	{
 		/* Erase current test result data */
-		for (uint8_t i = 0; i < 4; i++)
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
 		{
 			current_test_result.LOADED_battery_voltages[i] = 0;
 			current_test_result.UNLOADED_battery_voltages[i] = 0;
@@ -183,6 +189,7 @@ void discard_test_results(PB_INPUT_TYPE pb_type)
 		current_test_result.year = 0;
 		current_test_result.month = 0;
 		current_test_result.day = 0;
+		current_test_result.quality = 0;
 		
 		/* Erase old test data from EEPROM */
 		if (LOCAL_INTERFACE_CURRENT_STATE == VIEW_HISTORY_STATE) {
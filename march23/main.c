@@ -8,17 +8,65 @@ volatile char health_rating_lut[13][3] = {
 	"F  "							// 0x0C
 };
 
-test_result EEMEM test_results_history_eeprom[13];	// 507/512 bytes of available EEPROM
+test_result EEMEM test_results_history_eeprom[13];	// 325/512 bytes of available EEPROM for 4 cells, 429 for 6
+opamp_gain_calibration EEMEM opamp_gain_calibration_eeprom;	// Instrumentation amplifier gain calibration table
+knob_map EEMEM knob_map_eeprom;	// Learned carbon pile knob map
+
+//***************************************************************************
+//
+// Function Name : "eeprom_block_checksum"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Two's complement sum of the bytes of an EEPROM block in front of its
+//	checksum byte, so a valid block sums to 0. Shared by the blocks that
+//	end in a checksum: the gain calibration table and the knob map.
+//
+// Inputs :
+//		const void *block: block in RAM
+//		uint8_t length: bytes covered, the checksum byte follows them
+//
+// Outputs :
+//		uint8_t checksum: value to store in the checksum byte
+//
+//**************************************************************************
+uint8_t eeprom_block_checksum(const void *block, uint8_t length)
+{
+	const uint8_t *bytes = (const uint8_t *)block;
+	uint8_t sum = 0;
+
+	for (uint8_t i = 0; i < length; i++)
+		sum += bytes[i];
+	return (uint8_t)(-sum);
+}
+
+/* Default sweep test currents in A, unused entries are 0 */
+static const uint16_t load_sweep_default_currents_a[LOAD_SWEEP_MAX_STEPS] = {100, 200, 300, 400, 500};
 
 int main(void)
 {
 	adc_mode = 0x00;
-	adc_value = 0;
-	adc_vref = 3.3;
+	adc_value_uv = 0;
+	adc_vref_mv = 3300;
 	battery_voltage_divider_ratios = 5;
 	current_sensing_voltage_divider_ratios = 6;
-	shunt_resistance_ohms = 0.00008;
-	OPAMP_gain = 30;
+	shunt_resistance_uohms = 80;
+	OPAMP_gain = 15;	// Gain of the OP0/OP2 ladders, current scales use the same value
+	capture_depth = CAPTURE_MAX_FRAMES;
+	capture_pre_trigger = CAPTURE_MAX_FRAMES - 8;	// 8 frames (40ms) after the trigger
+	capture_rate_hz = 1000;	// 200 frames per second
+	load_control.kp_q8 = LOAD_CONTROL_KP_Q8;
+	load_control.ki_q8 = LOAD_CONTROL_KI_Q8;
+	load_control.max_rate_hz = LOAD_CONTROL_MAX_RATE_HZ;
+	load_control.tolerance_ma = LOAD_CONTROL_TOLERANCE_MA;
+	load_control.settle_ms = LOAD_CONTROL_SETTLE_MS;
+	load_control.timeout_ms = LOAD_CONTROL_TIMEOUT_MS;
+	load_sweep_steps = 0;
+	for (uint8_t k = 0; k < LOAD_SWEEP_MAX_STEPS; k++)
+	{
+		load_sweep_currents_a[k] = load_sweep_default_currents_a[k];
+		if (load_sweep_currents_a[k] != 0)
+			load_sweep_steps = k + 1;
+	}
 	cursor = 1;
 	quad_pack_entry = 0;
 	
@@ -30,8 +78,37 @@ int main(void)
 	/* Initialize LCD */
 	init_lcd();
 	
-	/* Initialize ADC */
+	/* Initialize timestamp counter used to time-stamp ADC conversions */
+	timestamp_init();
+	
+	/* Initialize ADC and precompute the integer measurement scale factors */
 	ADC_init(0x00);
+	measurement_scales_init();
+	
+	/* Characterize the ADC against DAC0 and report settings that could not be corrected */
+	if (ADC_selftest_characterize() != 0)
+	{
+		clear_lcd();
+		sprintf(dsp_buff[0], "ADC self-test failed");
+		sprintf(dsp_buff[1], "Readings uncorrected");
+		update_lcd();
+		_delay_ms(1500);
+	}
+	
+	/* Initialize Instrumentation Amplifier and check its gain calibration */
+	OPAMP_Instrumentation_init();
+	if (!opamp_gain_calibration_load())
+	{
+		clear_lcd();
+		sprintf(dsp_buff[0], "No valid gain cal   ");
+		sprintf(dsp_buff[1], "Using nominal gain  ");
+		update_lcd();
+		_delay_ms(1500);
+	}
+	
+	/* Initialize stepper motor driver and its step timer, and read the learned knob map */
+	stepper_init();
+	knob_map_load();
 	
 	/* Initialize Fan PWM module */
 	Fan_PWM_init();
@@ -39,12 +116,28 @@ int main(void)
 	/* Initialize pushbutton IO pins */
 	PB_init();
 	
+	/* OK held at power-up enters the amplifier gain calibration */
+	if (!(PORTA.IN & PIN2_bm))
+		LOCAL_INTERFACE_CURRENT_STATE = CALIBRATION_STATE;
+	
+	/* DOWN held at power-up benchmarks the cell measurement strategies on the connected pack */
+	if (!(PORTA.IN & PIN5_bm))
+		tap_solver_view();
+	
+	/* UP held at power-up sweeps the knob for a new map, after interrupts are on for the step timer */
+	uint8_t knob_sweep = !(PORTA.IN & PIN4_bm);
+	
 	LOCAL_INTERFACE_FSM();
 
 	sei(); // enable interrupts
+	
+	if (knob_sweep)
+		knob_map_view();
 
 	while(1)
 	{
-		asm volatile("nop");
+		/* Pushbutton ISRs only record the press, the fsm runs here with interrupts enabled */
+		if (PB_PRESS != NONE)
+			LOCAL_INTERFACE_FSM();
 	}
 }
@@ -10,35 +10,175 @@
 #include <avr/eeprom.h>
 #include<math.h>
 #include <string.h>
+#include <stdlib.h>
 
 #define B1_ADC_CHANNEL	0x00	// AIN0 -> PD0: Battery cell 1 positive terminal
 #define B2_ADC_CHANNEL	0x06	// AIN5 -> PD5: Battery cell 2 positive terminal
 #define B3_ADC_CHANNEL	0x07	// AIN2 -> PD2: Battery cell 3 positive terminal
 #define B4_ADC_CHANNEL	0x03	// AIN3 -> PD3: Battery cell 4 positive terminal
+#define B5_ADC_CHANNEL	0x08	// AIN8 -> PE0: Battery cell 5 positive terminal, 5S and 6S packs
+#define B6_ADC_CHANNEL	0x14	// AIN20 -> PF4: Battery cell 6 positive terminal, 6S packs
 #define GND_ADC_CHANNEL	0x40	// AIN -> GND
+
+/* Pack under test, chosen at build time with -DPACK_CELL_COUNT=n. The cell count sizes the scan
+   tables, the result layout and the grading loop, so no variant pays for cells it does not have */
+#ifndef PACK_CELL_COUNT
+#define PACK_CELL_COUNT	4
+#endif
+
+/* Tap pair of every cell: X(cell number, positive tap, negative tap, mode). Cell 1 is read
+   single-ended against GND, the others differentially against the tap below them */
+#define PACK_CELL_1(X)	X(1, B1_ADC_CHANNEL, GND_ADC_CHANNEL, 0x00)
+#define PACK_CELL_2(X)	X(2, B2_ADC_CHANNEL, B1_ADC_CHANNEL, 0x01)
+#define PACK_CELL_3(X)	X(3, B3_ADC_CHANNEL, B2_ADC_CHANNEL, 0x01)
+#define PACK_CELL_4(X)	X(4, B4_ADC_CHANNEL, B3_ADC_CHANNEL, 0x01)
+#define PACK_CELL_5(X)	X(5, B5_ADC_CHANNEL, B4_ADC_CHANNEL, 0x01)
+#define PACK_CELL_6(X)	X(6, B6_ADC_CHANNEL, B5_ADC_CHANNEL, 0x01)
+
+/* PACK_CELLS(X) expands X for every cell bottom to top, PACK_CELLS_REVERSED top to bottom */
+#if PACK_CELL_COUNT == 2
+#define PACK_CELLS(X)	PACK_CELL_1(X) PACK_CELL_2(X)
+#define PACK_CELLS_REVERSED(X)	PACK_CELL_2(X) PACK_CELL_1(X)
+#define PACK_TOP_ADC_CHANNEL	B2_ADC_CHANNEL
+#elif PACK_CELL_COUNT == 3
+#define PACK_CELLS(X)	PACK_CELL_1(X) PACK_CELL_2(X) PACK_CELL_3(X)
+#define PACK_CELLS_REVERSED(X)	PACK_CELL_3(X) PACK_CELL_2(X) PACK_CELL_1(X)
+#define PACK_TOP_ADC_CHANNEL	B3_ADC_CHANNEL
+#elif PACK_CELL_COUNT == 4
+#define PACK_CELLS(X)	PACK_CELL_1(X) PACK_CELL_2(X) PACK_CELL_3(X) PACK_CELL_4(X)
+#define PACK_CELLS_REVERSED(X)	PACK_CELL_4(X) PACK_CELL_3(X) PACK_CELL_2(X) PACK_CELL_1(X)
+#define PACK_TOP_ADC_CHANNEL	B4_ADC_CHANNEL
+#elif PACK_CELL_COUNT == 5
+#define PACK_CELLS(X)	PACK_CELL_1(X) PACK_CELL_2(X) PACK_CELL_3(X) PACK_CELL_4(X) PACK_CELL_5(X)
+#define PACK_CELLS_REVERSED(X)	PACK_CELL_5(X) PACK_CELL_4(X) PACK_CELL_3(X) PACK_CELL_2(X) PACK_CELL_1(X)
+#define PACK_TOP_ADC_CHANNEL	B5_ADC_CHANNEL
+#elif PACK_CELL_COUNT == 6
+#define PACK_CELLS(X)	PACK_CELL_1(X) PACK_CELL_2(X) PACK_CELL_3(X) PACK_CELL_4(X) PACK_CELL_5(X) PACK_CELL_6(X)
+#define PACK_CELLS_REVERSED(X)	PACK_CELL_6(X) PACK_CELL_5(X) PACK_CELL_4(X) PACK_CELL_3(X) PACK_CELL_2(X) PACK_CELL_1(X)
+#define PACK_TOP_ADC_CHANNEL	B6_ADC_CHANNEL
+#else
+#error "PACK_CELL_COUNT must be 2 ... 6, the 13 entry history must fit the EEPROM"
+#endif
+
+/* Channel ID of a cell, for building scan tables from PACK_CELLS() */
+#define PACK_CELL_CHANNEL_ID(n, pos, neg, mode)	ADC_CH_B##n,
+/* Channel ID of the single-ended tap at the top of a cell, for the tap-voltage solver */
+#define PACK_TAP_CHANNEL_ID(n, pos, neg, mode)	ADC_CH_T##n,
+
+#define LCD_LINES	4	// Lines of the DOG LCD, cells beyond it are paged with UP/DOWN
 #define OPAMP_ADC_CHANNEL	0x0A	// AIN10 -> PE2: OPAMP 2 output
+#define DAC0_ADC_CHANNEL	0x48	// DAC0 output, internal loopback for the ADC self-test
+#define TEMPSENSE_ADC_CHANNEL	0x42	// Internal temperature sensor
+#define TEMPSENSE_SAMPLEN	32	// Extra sampling ADC clocks, the sensor needs >= 32us
+
+#define ADC_RING_SIZE	16	// Scan sequencer result ring buffer entries, must be a power of 2
+#define ADC_CODE_FULL_SCALE	65536UL	// Normalized ADC codes are in units of 1/65536 of VREF
+#define CELL_SAMPNUM	ADC_SAMPNUM_ACC16_gc	// Accumulation of the cell and tap channels outside the solver, 14 bits
+#define LOADED_SNAPSHOT_LENGTH	(2 * PACK_CELL_COUNT + 3)	// Conversions in a time-aligned loaded snapshot scan
+#define TIMESTAMP_TICKS_PER_US	(F_CPU / 2000000UL)	// TCB1 timestamp counter runs at CLK_PER/2
+#define RTC_CLOCK_HZ	32768UL	// RTC sample clock source, internal 32.768kHz oscillator
+#define SAMPLE_CLOCK_MAX_HZ	4096	// Fastest sample clock, leaves room for a 4 sample accumulation
+#define CAPTURE_CHANNELS	(PACK_CELL_COUNT + 1)	// Load current and every cell in each capture frame
+#define CAPTURE_MAX_FRAMES	64	// Capture buffer size, 2 * CAPTURE_CHANNELS bytes of RAM per frame
+#define ADC_CAL_POINTS	7		// DAC loopback levels, 1/8 ... 7/8 of VREF
+#define ADC_CAL_STEP_BITS	13
+#define ADC_CAL_STEP	(1L << ADC_CAL_STEP_BITS)	// Code spacing of the loopback levels
+#define ADC_CAL_SHIFT	14		// ADC gain corrections are fixed point with 14 fraction bits
+#define ADC_CAL_ONE	(1L << ADC_CAL_SHIFT)	// ADC gain correction of 1.0
+#define ADC_CAL_MAX_OFFSET	2048	// Largest plausible offset in codes, ~3% of VREF
+#define ADC_CAL_MAX_INL	512		// Largest plausible nonlinearity in codes, ~8 LSB at 12 bits
+#define ADC_SAMPNUM_SETTINGS	8	// ADC_SAMPNUM_NONE_gc ... ADC_SAMPNUM_ACC128_gc
+#define ADC_REFERENCES	4		// 1.024V, 2.048V, 4.096V and VDD at most
+#define ADC_REF_HEADROOM_MV	500	// An internal reference needs VDD this much above it
+#define ADC_REF_SETTLE_CONVERSIONS	4	// Single conversions discarded after a reference change
+#define ADC_REF_SETTLE_US	60	// Reference start-up time before free-running or clocked conversions
+#define ADC_REF_SCALE_SHIFT	13	// Reference to VDD code scales are fixed point with 13 fraction bits
+#define ADC_REF_SCALE_ONE	(1U << ADC_REF_SCALE_SHIFT)
+#define ADC_RANGE_CLIP_Q8	250	// Level in 1/256 of full scale treated as clipped, converted again
+#define ADC_RANGE_UP_Q8		240	// Level that moves the next scan to a larger reference
+#define ADC_RANGE_DOWN_Q8	205	// Level a reading must stay under on the smaller reference to move down
+#define ADC_PRESCALER	4		// CLK_ADC = CLK_PER / 4, set in ADC_init()
+#define ADC_CONVERSION_CLOCKS	15	// ADC clocks per 12-bit sample with the shortest sampling
+#define SCHEDULE_HEADROOM	8	// Scheduler runs 1/8 more slots than the table asks for
+#define SCHEDULE_IDLE	0xFF	// Scheduler slot without a class
+#define MEASUREMENT_SAMPLES	8	// Samples per stored cell reading, statistics are taken over them
+#define MEASUREMENT_RETAKES	2	// Extra attempts when a reading is noisy or out of range
+#define UNLOADED_MAX_STDDEV_MV	10	// Noise limit of an unloaded cell reading
+#define LOADED_MAX_STDDEV_MV	30	// Noise limit of a loaded cell reading, the load itself adds ripple
+#define CELL_MIN_MV	500		// Plausible cell voltage window, outside it a tap is open or shorted
+#define CELL_MAX_MV	4500
+#define CELL_TARGET_SIGMA_UV	1000	// Noise of one cell scan the tap-voltage solver has to reach
+#define TAP_SOLVER_NOISE_LSB_Q4	16	// Noise of one 12-bit conversion in 1/16 LSB rms, quantization included
+#define TAP_SOLVER_SETTLE_CONVERSIONS	2	// Fewest conversions before a switched input counts as settled
+#define TAP_SOLVER_BENCH_SCANS	32	// Timed scans per strategy in the benchmark
+#define TAP_DIAGNOSTIC_LENGTH	(2 * PACK_CELL_COUNT + 1)	// Taps, cells and pack in the pre-test check
+#define TAP_DIAGNOSTIC_TOLERANCE_MV	150	// Allowed disagreement of a cell read two ways, per cell for the pack sum
+#define FILTER_MAX_WINDOW	7	// Longest streaming filter window, odd, bounds the per-sample sort
+#define FILTER_HAMPEL_K_Q4	71	// Hampel outlier limit, 3 sigma = 3 * 1.4826 MAD = 71/16 MAD
+#define CAPTURE_TRIGGER_FILTER	FILTER_MEDIAN	// Capture trigger needs most of the window above 500A
+#define CAPTURE_TRIGGER_WINDOW	5
+#define LOAD_CONTROL_FILTER	FILTER_HAMPEL	// Stepper loops keep real steps undelayed, drop spikes
+#define LOAD_CONTROL_WINDOW	5
+#define STEPPER_TICKS_PER_S	(1000000UL * TIMESTAMP_TICKS_PER_US)	// TCB0 step timer runs at CLK_PER/2
+#define STEPPER_MIN_RATE_HZ	31		// Slowest rate the 16-bit step timer can time
+#define STEPPER_MAX_RATE_HZ	3000	// Fastest knob step rate
+#define STEPPER_ACCEL_HZ_PER_S	20000	// Step rate ramp, keeps the NEMA-17 from stalling
+#define STEPPER_RAMP_LENGTH	((uint16_t)((uint32_t)STEPPER_MAX_RATE_HZ * STEPPER_MAX_RATE_HZ / (2UL * STEPPER_ACCEL_HZ_PER_S)) + 1)
+#define LOAD_CONTROL_PERIOD_US	1000	// Current controller sample period and integration step, a multiple of 100us
+#define LOAD_CONTROL_KP_Q8	(16 << 8)	// Step rate per amp of error, Hz/A
+#define LOAD_CONTROL_KI_Q8	(1 << 8)	// Step rate per amp-second of error, Hz/(A s)
+#define LOAD_CONTROL_MAX_RATE_HZ	2000	// Fastest knob step rate
+#define LOAD_CONTROL_TOLERANCE_MA	5000	// Settle band around the target
+#define LOAD_CONTROL_SETTLE_MS	200		// Time the current has to stay inside the band
+#define LOAD_CONTROL_TIMEOUT_MS	10000	// set_load_current() gives up after this long
+#define OPAMP_ZERO_MAX_MA	60000L	// Largest offset auto-zero accepts, more means current is flowing
+#define LOAD_CURRENT_DEADBAND_MA	2000	// Noise floor of an auto-zeroed current reading
+#define OPAMP_CAL_POINTS	8	// Breakpoints in the amplifier gain calibration table
+#define OPAMP_CAL_MAGIC	0x6A31	// Marks a gain calibration table written by this firmware
+#define OPAMP_CAL_SHIFT	14		// Gain corrections are fixed point with 14 fraction bits
+#define OPAMP_CAL_ONE	(1U << OPAMP_CAL_SHIFT)	// Gain correction of 1.0
+#define OPAMP_CAL_SLOPE_SHIFT	12	// Fraction bits of the precomputed segment slopes
+#define LOAD_HOLD_MS	1000	// Constant-current hold of an automated test
+#define LOAD_HOLD_MEASURE_PCT	50	// Share at the end of the hold the loaded voltages are averaged over
+#define LOAD_HOLD_LOG_POINTS	32	// Regulation errors kept through a hold
+#define LOAD_SWEEP_MAX_STEPS	8	// Currents of a sweep test, the current setting included
+#define LOAD_SWEEP_HOLD_MS	400	// Constant-current hold of every sweep step
+#define LOAD_SWEEP_RESIDUAL_MV	10	// A step further than this from the fitted line marks the cell
+#define LOAD_OPEN_ZERO_READINGS	5	// Readings in the deadband in a row that confirm an open load
+#define LOAD_OPEN_STALL_STEPS	400	// Retract steps the current has to fall over ...
+#define LOAD_OPEN_STALL_DROP_MA	5000	// ... by at least this much, or the knob is taken as stalled
+#define KNOB_MAP_POINTS	12		// Knob positions in the learned load map
+#define KNOB_MAP_MAGIC	0x4B31	// Marks a knob map written by this firmware
+#define KNOB_MAP_SWEEP_STEP	32		// Steps between readings of the characterization sweep
+#define KNOB_MAP_SWEEP_SAMPLES	96	// Readings the sweep can keep, bounds the travel it maps
+#define KNOB_MAP_SWEEP_RATE_HZ	1000	// Knob rate between sweep readings
+#define KNOB_MAP_SWEEP_MAX_MA	500000L	// Sweep stops once the load draws this much
+#define KNOB_MAP_APPROACH_PCT	90		// Feedforward aims at this share of the target, the controller trims the rest
+#define KNOB_MAP_LEARN_SHIFT	1		// A settled reading moves the map by 1/2 of its error
+#define OPAMP_CAL_MIN_CODE	512	// Smallest output (~0.8% of VREF) and spacing of calibration points
 
 /* Display buffer for DOG LCD using sprintf(). 4 lines, 21 characters per line */
 char dsp_buff[4][21];
 
 /*Global variable Declarations*/
 volatile uint8_t adc_mode;	// ADC conversion mode: 0x00 -> single-ended, 0x01 -> differential
-volatile float adc_value;	// Analog Voltage read from ADC in volts
-volatile float adc_vref;	// Reference voltage used by ADC in volts
+volatile int32_t adc_value_uv;	// Analog Voltage read from ADC in microvolts
+volatile uint16_t adc_vref_mv;	// Reference voltage used by ADC in millivolts
 
 volatile uint8_t battery_voltage_divider_ratios;	// Voltage divider ratio used for measuring battery cells
 
-volatile float load_current_amps;		// Load current value in Amps
+volatile int32_t load_current_ma;		// Load current value in milliamps
 volatile uint8_t current_sensing_voltage_divider_ratios;	// Voltage divider ratio used for measuring voltage across shunt
-volatile float shunt_resistance_ohms;	// 0.8 milli-ohms
+volatile uint16_t shunt_resistance_uohms;	// 80 micro-ohms
 volatile uint8_t OPAMP_gain;	// Gain configuration for current sensing instrumentation amplifier
 volatile float temp;	// temporary variable
 
 volatile uint8_t cursor;	// LCD cursor line position (1,2,3,4)
-volatile uint8_t quad_pack_entry;	// quad pack entry that cursor is pointing to, row index for 13x4 history matrices
+volatile uint8_t quad_pack_entry;	// quad pack entry that cursor is pointing to, row index for 13 entry history
+volatile uint8_t cell_page;	// First cell on the LCD when a pack has more cells than LCD_LINES
 
-/* buffer array storing the health ratings of all 4 cells as strings, [0:2]->B1, [3:5]->B2, [6:8]->B3, [9:11]->B4 */
-volatile char health_rating_characters[12];
+/* buffer array storing the health ratings of all cells as strings, [3*i : 3*i+2] -> cell i + 1 */
+volatile char health_rating_characters[3 * PACK_CELL_COUNT];
 
 /* Look-up table used to map the loaded voltages to a health rating string */
 extern volatile char health_rating_lut[13][3];
@@ -52,17 +192,53 @@ volatile uint8_t current_setting_1_dig;
 volatile uint8_t voltage_precision;
 
 typedef struct {
-	float UNLOADED_battery_voltages[4];		// UNLOADED Battery cell voltages : 4 floats = 16 bytes
-	float LOADED_battery_voltages[4];		// LOADED Battery cell voltages : 4 floats = 16 bytes
+	uint16_t UNLOADED_battery_voltages[PACK_CELL_COUNT];	// UNLOADED Battery cell voltages in mV : 2 bytes per cell
+	uint16_t LOADED_battery_voltages[PACK_CELL_COUNT];	// LOADED Battery cell voltages in mV : 2 bytes per cell
 	uint16_t max_load_current;	// Max load current used to test battery : 2 bytes
-	uint8_t test_mode;			// 0x00 -> Manual test, 0x01 -> Automated test : 1 byte
+	uint8_t test_mode;			// 0x00 -> Manual test, 0x01 -> Automated test, 0x02 -> Sweep test : 1 byte
 	uint8_t ampient_temp;		// Ambient temperature during test in degrees celcius : 1 bytes
 	uint8_t year, month, day;	// 20xx, 0-12, 0-31 : 3 bytes
-	// SIZE = 16 + 16 + 2 + 1 + 1 + 3 = 39 bytes
+	uint16_t quality;			// QUALITY_UNLOADED_BAD(i) / QUALITY_LOADED_BAD(i) flags : 2 bytes
+	// SIZE = 4 * PACK_CELL_COUNT + 2 + 1 + 1 + 3 + 2 = 25 bytes for 4 cells, 33 bytes for 6 cells
 } test_result;
 
-/* Data log of 13 previous quad-pack tests, stored in MCU's internal EEPROM storage */
-extern test_result EEMEM test_results_history_eeprom[13];	// 507/512 bytes of available EEPROM
+/* Quality flags of the cell readings in test_result.quality */
+#define QUALITY_UNLOADED_BAD(i)	(0x0001 << (i))	// UNLOADED reading of cell i failed its quality check
+#define QUALITY_LOADED_BAD(i)	(0x0100 << (i))	// LOADED reading of cell i failed its quality check
+#define QUALITY_UNLOADED_MASK	0x00FF
+#define QUALITY_LOADED_MASK		0xFF00
+
+/* Data log of 13 previous tests, stored in MCU's internal EEPROM storage. The layout depends on
+   PACK_CELL_COUNT, a history written by a build for another pack size reads back as garbage */
+extern test_result EEMEM test_results_history_eeprom[13];	// 325/512 bytes of available EEPROM for 4 cells, 429 for 6
+
+/* Piecewise-linear instrumentation amplifier gain calibration, output code versus gain correction */
+typedef struct {
+	uint16_t code[OPAMP_CAL_POINTS];		// Amplifier output breakpoints in 1/65536 of VREF, increasing
+	uint16_t correction[OPAMP_CAL_POINTS];	// Nominal gain / actual gain at each breakpoint, OPAMP_CAL_ONE = 1.0
+	uint8_t count;		// Breakpoints in use
+	uint8_t gain;		// OPAMP_gain the table was recorded at
+	uint16_t magic;		// OPAMP_CAL_MAGIC
+	uint8_t checksum;	// Bytes of the table sum to 0
+	// SIZE = 16 + 16 + 1 + 1 + 2 + 1 = 37 bytes
+} opamp_gain_calibration;
+
+extern opamp_gain_calibration EEMEM opamp_gain_calibration_eeprom;	// 362/512 bytes of available EEPROM for 4 cells, 466 for 6
+extern opamp_gain_calibration opamp_gain_cal;	// Table in use, count is 0 when none is valid
+
+/* Learned carbon pile knob map, load conductance at evenly spaced knob positions from open circuit.
+   Conductance is the load current per volt of unloaded pack, so one map serves every pack voltage */
+typedef struct {
+	uint16_t conductance[KNOB_MAP_POINTS];	// At position k * spacing, 1/256 A/V, non-decreasing
+	uint16_t spacing;	// Steps between points
+	uint16_t updates;	// Settled load changes that refined the map since the sweep
+	uint16_t magic;		// KNOB_MAP_MAGIC
+	uint8_t checksum;	// Bytes of the map sum to 0
+	// SIZE = 24 + 2 + 2 + 2 + 1 = 31 bytes
+} knob_map;
+
+extern knob_map EEMEM knob_map_eeprom;	// 393/512 bytes of available EEPROM for 4 cells, 497 for 6
+extern knob_map knob_map_active;	// Map in use, spacing is 0 when none is valid
 volatile test_result current_test_result;	// data from most recent quad-pack test
 
 
@@ -72,7 +248,8 @@ typedef enum {
 	MAIN_MENU_STATE,
 	TEST_STATE,
 	VIEW_HISTORY_STATE,
-	SETTINGS_STATE
+	SETTINGS_STATE,
+	CALIBRATION_STATE	// Amplifier gain calibration, entered by holding OK at power-up
 }  LOCAL_INTERFACE_FSM_STATES;
 
 /* States for the fsm that performs the test procedure */
@@ -86,9 +263,19 @@ typedef enum {
 	DISCARD_RESULTS_T,			// Confirm that user would like to discard test results without saving
 	SAVE_CURRENT_RESULTS,		// Confirm that user would like to save current test results
 	SCROLL_SAVE_ENTRIES,		// Scroll through quad pack entries to save current test results
-	OVERWRITE_RESULTS			// Confirm that user would like to overwrite previous test results
+	OVERWRITE_RESULTS,			// Confirm that user would like to overwrite previous test results
+	CAPTURE_VIEW_T,				// Step through the waveform captured while the load was applied
+	SWEEP_VIEW_T				// Display the DC internal resistance fitted by a sweep test
 }  TEST_FSM_STATES;
 
+/* States of the pre-trigger waveform capture */
+typedef enum {
+	CAPTURE_IDLE,		// No capture recorded
+	CAPTURE_FILLING,	// Recording into the circular buffer, waiting for the trigger
+	CAPTURE_TRIGGERED,	// Trigger seen, recording the post-trigger frames
+	CAPTURE_DONE		// Buffer frozen, ready to view
+}  CAPTURE_STATE;
+
 /* States for the fsm that views previous results */
 typedef enum {
 	SCROLL_PREVIOUS_RESULTS,	// Scroll through quad pack entries where previous test results are saved
@@ -115,6 +302,276 @@ typedef enum {
 	NONE	// Neutral PB state to prevent FSM functions from acting on wrong PB press
 }  PB_INPUT_TYPE;
 
+/* Entries of the ADC scan sequencer channel descriptor table */
+typedef enum {
+	PACK_CELLS(PACK_CELL_CHANNEL_ID)	// ADC_CH_B1: B1_POS - GND single-ended, ADC_CH_Bn: Bn_POS - Bn-1_POS differential
+	ADC_CH_LOAD_CURRENT,	// Instrumentation amplifier output, single-ended
+	ADC_CH_PACK,			// Top tap - GND, whole pack single-ended
+	ADC_CH_DAC_LOOPBACK,	// DAC0 - GND, self-test, reference, mode and accumulation set by the self-test
+	ADC_CH_TEMPERATURE,		// Internal temperature sensor, single-ended
+	PACK_CELLS(PACK_TAP_CHANNEL_ID)	// ADC_CH_Tn: Bn_POS - GND single-ended, taps for the tap-voltage solver
+	ADC_CHANNEL_COUNT
+}  ADC_CHANNEL_ID;
+
+/* Scan sequencer channel descriptor */
+typedef struct {
+	uint8_t muxpos;		// MUXPOS: positive (or single-ended) analog input
+	uint8_t muxneg;		// MUXNEG: negative analog input, differential mode only
+	uint8_t mode;		// 0x00 -> single-ended, 0x01 -> differential
+	uint8_t sampnum;	// CTRLB accumulation, ADC_SAMPNUM_xxx_gc
+	uint8_t settle_timeout;	// Most settling conversions after switching to this channel, 0 -> no settling
+	uint8_t samplen;	// SAMPCTRL: extra sampling ADC clocks
+	uint8_t autorange;	// 0x01 -> scans pick the reference from the last reading, 0x00 -> always VDD
+} adc_channel_descriptor;
+
+/* Signal classes of the multi-rate scheduler, in priority order */
+typedef enum {
+	SCHEDULE_CURRENT,		// Load current
+	SCHEDULE_CELLS,			// Battery cell taps
+	SCHEDULE_TEMPERATURE,	// Internal temperature
+	SCHEDULE_CLASS_COUNT
+}  SCHEDULE_CLASS_ID;
+
+/* Multi-rate scheduler table entry */
+typedef struct {
+	const uint8_t *channels;	// Channel IDs of the class, sampled in turn
+	uint8_t count;				// Number of channels
+	uint16_t rate_hz;			// Samples per second of every channel
+} schedule_class;
+
+/* Multi-rate scheduler statistic of one class */
+typedef struct {
+	uint32_t samples;		// Results since scheduler_start()
+	uint16_t max_lateness;	// Most slots a sample was served after it was due
+	uint16_t overruns;		// Samples that fell a whole period behind
+} schedule_stats;
+
+/* Per-channel input settling statistic */
+typedef struct {
+	uint8_t last_conversions;	// Settling conversions used by the last scan of the channel
+	uint8_t max_conversions;	// Worst case since start-up
+	uint16_t timeouts;			// Scans where the input never settled within the timeout
+} adc_settle_stats;
+
+/* Scan sequencer ring buffer entry */
+typedef struct {
+	uint8_t channel;	// ADC_CHANNEL_ID that produced the result
+	uint8_t sampnum;	// Accumulation used for this result, ADC_SAMPNUM_xxx_gc
+	uint16_t raw;		// ADC0.RES, accumulated result, two's complement in differential mode
+	uint16_t timestamp;	// Middle of the conversion, TCB1 timestamp ticks
+	uint16_t sequence;	// Sample clock event that started the conversion, 0 for sequencer scans
+	uint8_t reference;	// Index into adc_reference_table of the reference used
+} adc_result;
+
+/* ADC reference usable for auto-ranging */
+typedef struct {
+	uint8_t refsel;		// VREF.ADC0REF selection
+	uint16_t mv;		// Reference voltage in mV
+	uint16_t scale;		// Codes on this reference -> codes of VDD, ADC_REF_SCALE_ONE = 1.0
+	uint16_t down_q8;	// Ratio to the next smaller reference, 8 fraction bits
+	uint8_t sampnum_reduction;	// Accumulation steps dropped for the same mV noise as on VDD
+} adc_reference;
+
+/* Time-aligned loaded measurement of all cells and the load current */
+typedef struct {
+	uint16_t cell_mv[PACK_CELL_COUNT];	// Cell voltages interpolated to the snapshot instant in mV
+	int32_t current_ma;			// Load current at the snapshot instant in mA
+	int32_t current_drift_ma;	// Change in load current from the first to the last conversion in mA
+	uint16_t window_us;			// Time from the first to the last conversion in us
+} loaded_snapshot;
+
+/* Ways of measuring the cells of the pack */
+typedef enum {
+	CELL_STRATEGY_DIFFERENTIAL,	// B1 single-ended, every other cell across its two taps
+	CELL_STRATEGY_TAPS,			// Every tap single-ended in one pass, cells by subtraction
+	CELL_STRATEGY_COUNT
+}  CELL_STRATEGY;
+
+/* Predicted cost and noise of one cell strategy at a pack voltage */
+typedef struct {
+	uint8_t feasible;	// 0x01 if every channel stays below the top of the widest reference
+	uint8_t sampnum;	// Accumulation of every channel, ADC_SAMPNUM_xxx_gc
+	uint16_t sigma_uv[PACK_CELL_COUNT];	// Noise of each cell of one scan in uV, propagated through the subtraction
+	uint16_t worst_sigma_uv;	// Largest of sigma_uv
+	uint32_t scan_us;	// Time of one scan including settling
+} cell_strategy_plan;
+
+/* Measured cost and noise of one cell strategy */
+typedef struct {
+	uint32_t scan_us;	// Mean time of one scan, 0 if the strategy was not run
+	uint16_t worst_sigma_uv;	// Largest standard deviation of a cell over the scans in uV
+} cell_strategy_benchmark;
+
+/* Balance lead faults found by the pre-test diagnostic pass, in the order they are checked */
+typedef enum {
+	TAP_FAULT_NONE,		// Every tap and cell plausible
+	TAP_FAULT_NO_PACK,	// Pack below 100mV, nothing connected
+	TAP_FAULT_OPEN,		// Tap pulled to ground by its divider
+	TAP_FAULT_REVERSED,	// Cell reads negative across its taps
+	TAP_FAULT_ORDER,	// Tap not above the tap below it
+	TAP_FAULT_RANGE,	// Cell outside CELL_MIN_MV ... CELL_MAX_MV
+	TAP_FAULT_MISMATCH,	// Cell across its taps and tap difference disagree
+	TAP_FAULT_SUM,		// Cells do not add up to the pack
+	TAP_FAULT_COUNT
+}  TAP_FAULT;
+
+/* Result of the pre-test diagnostic pass */
+typedef struct {
+	TAP_FAULT fault;	// First fault found
+	uint8_t tap;		// Tap to check, 0 -> B1+
+	int32_t measured_mv;	// Reading that failed, the pack voltage when none did
+	uint16_t duration_us;	// Time of the diagnostic scan
+} tap_diagnosis;
+
+/* Outcome of the last open_circuit_load() */
+typedef struct {
+	uint16_t retract_ms;	// Time until the current was confirmed zero, or until it gave up
+	uint32_t steps;			// Steps taken, braking included
+	uint8_t stalls;			// Times the current stopped falling and the rate was halved
+	uint8_t opened;			// 0x01 if the load is open
+} load_open_report;
+
+/* Step generator modes */
+typedef enum {
+	STEPPER_IDLE,	// No command
+	STEPPER_MOVE,	// Ramped move to a target position
+	STEPPER_RUN		// Ramped rotation at a commanded rate
+} STEPPER_MODE;
+
+/* Tuning and settle criterion of the load current controller, see set_load_current() */
+typedef struct {
+	uint16_t kp_q8;			// Proportional gain, Hz of step rate per amp, 8 fraction bits
+	uint16_t ki_q8;			// Integral gain, Hz of step rate per amp-second, 8 fraction bits
+	uint16_t max_rate_hz;	// Step rate limit, the integral is clamped to it as well
+	uint16_t tolerance_ma;	// Settled when the error stays within +/- this
+	uint16_t settle_ms;		// ... for this long
+	uint16_t timeout_ms;	// Gives up when not settled after this long
+} load_control_config;
+
+/* Outcome of the last set_load_current() */
+typedef struct {
+	int32_t target_ma;		// Requested current
+	int32_t final_ma;		// Filtered current with the knob stopped
+	int32_t overshoot_ma;	// Furthest the current went past the target, 0 if it never did
+	uint16_t time_to_target_ms;	// First time inside the tolerance band, 0xFFFF if never
+	uint16_t settle_time_ms;	// Time until settled, or until the timeout
+	uint32_t steps;			// Knob steps taken, both directions
+	uint8_t settled;		// 0x01 if the settle criterion was met
+} load_control_report;
+
+/* One capture frame: every channel of adc_scan_capture as code/2 (15 bits of VREF) */
+typedef struct {
+	int16_t value[CAPTURE_CHANNELS];
+} capture_frame;
+
+/* Streaming filter types */
+typedef enum {
+	FILTER_MEDIAN,	// Median of the window
+	FILTER_HAMPEL	// Sample unless it is an outlier against the window median
+}  FILTER_TYPE;
+
+/* Fixed memory streaming filter over the last samples of one signal */
+typedef struct {
+	int32_t window[FILTER_MAX_WINDOW];	// Circular sample window
+	uint8_t length;		// Window length in use, odd
+	uint8_t head;		// Next position to write
+	uint8_t count;		// Samples in the window, up to length
+	FILTER_TYPE type;
+} sample_filter;
+
+/* Running statistics of one measurement, integer Welford form */
+typedef struct {
+	uint16_t count;		// Samples added
+	int32_t mean_q8;	// Mean with 8 fraction bits
+	int64_t m2_q16;		// Sum of squared deviations from the mean with 16 fraction bits
+	int32_t min;		// Smallest sample
+	int32_t max;		// Largest sample
+} measurement_stats;
+
+/* Measurement quality flags */
+#define MEASUREMENT_OK				0x00
+#define MEASUREMENT_NOISY			0x01	// Standard deviation above the limit
+#define MEASUREMENT_OUT_OF_RANGE	0x02	// A sample outside the plausible window
+
+/* Regulation of the last load_hold() */
+typedef struct {
+	measurement_stats error_stats;	// Target minus current over the whole hold in mA
+	int32_t worst_error_ma;	// Largest error while the loaded voltages were averaged
+	int16_t error_log_da[LOAD_HOLD_LOG_POINTS];	// Error through the hold in 0.1A, evenly spaced
+	uint8_t log_count;		// Entries of error_log_da in use
+	uint16_t missed_ticks;	// Current samples the controller was too slow for
+	int16_t temperature_c;	// Die temperature at the end of the hold
+} load_hold_report;
+
+/* Steps and per-cell DC internal resistance of the last load_sweep_run() */
+typedef struct {
+	uint8_t steps;			// Steps held
+	uint8_t steady_mask;	// Bit k set if step k was steady and goes into the fit
+	uint8_t fit_points;		// Steps the fit used, 0 if there was no fit
+	int32_t current_ma[LOAD_SWEEP_MAX_STEPS];	// Mean current of every step
+	uint16_t cell_mv[LOAD_SWEEP_MAX_STEPS][PACK_CELL_COUNT];	// Mean cell voltages of every step
+	int32_t resistance_uohm[PACK_CELL_COUNT];	// Fitted DC internal resistance in micro-ohms
+	uint16_t ocv_mv[PACK_CELL_COUNT];		// Voltage of the fitted line at zero current
+	uint16_t residual_mv[PACK_CELL_COUNT];	// Largest distance of a step from the line
+} load_sweep_report;
+
+/* ADC correction of one reference, conversion mode and accumulation, from the DAC loopback self-test */
+typedef struct {
+	int16_t offset;		// Subtracted from the code first
+	uint16_t gain;		// Then multiplied, ADC_CAL_ONE = 1.0
+	int16_t inl[ADC_CAL_POINTS];	// Then the residual at (k + 1) * ADC_CAL_STEP is added, interpolated
+	uint8_t valid;		// 0x01 once characterized, uncorrected otherwise
+} adc_calibration;
+
+/* Precomputed integer scale factor: result = (code * multiplier) >> shift */
+typedef struct {
+	uint32_t multiplier;	// scale normalized so the largest code times multiplier fits in 31 bits
+	uint8_t shift;			// right shift applied after the multiply
+} fixed_point_scale;
+
+fixed_point_scale adc_scale_uv;				// ADC code -> microvolts at the ADC pin
+fixed_point_scale cell_scale_mv;			// ADC code -> millivolts across a battery cell
+fixed_point_scale load_current_scale_ma;	// ADC code -> milliamps through the shunt
+
+extern adc_channel_descriptor adc_channel_table[ADC_CHANNEL_COUNT];
+extern uint8_t adc_settle_tolerance;	// Settled when consecutive conversions differ by at most this many LSBs
+extern adc_settle_stats adc_settle_statistics[ADC_CHANNEL_COUNT];
+extern int32_t opamp_offset_code;	// Amplifier output with the load open, subtracted by ADC_code()
+extern adc_reference adc_reference_table[ADC_REFERENCES];	// Usable references, smallest first, VDD last
+extern uint8_t adc_reference_count;
+extern const schedule_class adc_schedule_table[SCHEDULE_CLASS_COUNT];	// Declarative sampling rates
+extern schedule_stats adc_schedule_statistics[SCHEDULE_CLASS_COUNT];
+uint16_t adc_utilization_permille;	// ADC busy time while the scheduler last ran, 1/1000
+extern const uint8_t adc_scan_cells[PACK_CELL_COUNT];	// B1 ... top cell scan order
+extern const uint8_t adc_scan_taps[PACK_CELL_COUNT];	// T1 ... top tap scan order, single-ended
+extern const uint8_t adc_scan_load_current[1];	// Shunt amplifier only
+extern const uint8_t adc_scan_pack[1];			// Whole pack only
+extern const uint8_t adc_scan_dac_loopback[1];	// DAC0 self-test only
+extern adc_calibration adc_calibration_table[ADC_REFERENCES][2][ADC_SAMPNUM_SETTINGS];	// [reference][mode][sampnum]
+extern const uint8_t adc_scan_snapshot[LOADED_SNAPSHOT_LENGTH];	// Interleaved current and cells
+loaded_snapshot last_loaded_snapshot;	// Most recent loaded snapshot, kept for display and diagnostics
+measurement_stats unloaded_cell_stats[PACK_CELL_COUNT];	// Statistics of the stored UNLOADED cell readings in mV
+measurement_stats loaded_cell_stats[PACK_CELL_COUNT];		// Statistics of the stored LOADED cell readings in mV
+int32_t pack_voltage_mv;		// Whole pack at the last connection check in mV
+tap_diagnosis last_tap_diagnosis;	// Pre-test check of the last test started
+load_control_config load_control;	// Load current controller tuning, defaults set in main()
+load_control_report last_load_control;	// Time to target and overshoot of the last load current change
+load_open_report last_load_open;	// Duration and stalls of the last retract
+load_hold_report last_load_hold;	// Regulation error of the last constant-current hold
+uint16_t load_sweep_currents_a[LOAD_SWEEP_MAX_STEPS];	// Sweep test currents below the current setting in A, defaults set in main()
+uint8_t load_sweep_steps;			// Entries of load_sweep_currents_a in use
+load_sweep_report last_load_sweep;	// Internal resistance fit of the last sweep test
+CELL_STRATEGY cell_strategy;	// Strategy tap_solver_read() measures the cells with
+cell_strategy_plan cell_strategy_plans[CELL_STRATEGY_COUNT];	// Predictions of the last tap_solver_select()
+cell_strategy_benchmark cell_strategy_benchmarks[CELL_STRATEGY_COUNT];	// Results of the last tap_solver_benchmark()
+measurement_stats loaded_current_stats;		// Statistics of the load current during the LOADED readings in mA
+volatile uint16_t sample_clock_period;	// RTC ticks (1/32768s) between sample clock events
+volatile uint16_t adc_clocked_missed;	// Sample clock events that produced no result since ADC_clocked_start()
+extern const uint8_t adc_scan_capture[CAPTURE_CHANNELS];	// Current and cells, round robin on the sample clock
+uint8_t capture_depth;			// Frames kept in the capture buffer, up to CAPTURE_MAX_FRAMES
+uint8_t capture_pre_trigger;	// Frames kept from before the trigger
+uint16_t capture_rate_hz;		// Sample clock rate while capturing, one channel per event
+
 /* 24-bit unsigned integer type */
 typedef struct {
 	uint8_t upper;	// Upper byte:  [23:16]
@@ -129,6 +586,9 @@ volatile VIEW_HISTORY_FSM_STATES VIEW_HISTORY_CURRENT_STATE;
 volatile SETTINGS_FSM_STATES SETTING_CURRENT_STATE;
 volatile PB_INPUT_TYPE PB_PRESS;	// Always reset to NONE after handling a PB interrupt, eliminates ambiguity on next PB press
 
+/* EEPROM Functions -> File Location: "main.c" */
+uint8_t eeprom_block_checksum(const void *block, uint8_t length);	// Checksum byte that makes a block sum to 0
+
 /* LCD Functions -> File Location: "lcd.c" */
 void lcd_spi_transmit (char cmd); // transmits character using spi
 void init_spi_lcd (void);	// initializes spi module of AVR128DB48
@@ -142,15 +602,143 @@ void ADC_startConversion(void);	// Starts a conversion by the ADC
 void ADC_stopConversion(void);	// Stops a conversion by the ADC
 uint8_t ADC_isConversionDone(void);	// Checks if ADC conversion is finished
 void ADC_channelSEL(uint8_t AIN_POS, uint8_t AIN_NEG);	// Selects ADC channel
-float ADC_read(void);	// Returns result from ADC
-float batteryCell_read(uint8_t BAT_POS, uint8_t BAT_NEG); // reads voltage across 2 battery terminals
+uint8_t ADC_scan_start(const uint8_t *sequence, uint8_t length);	// Starts an interrupt-driven scan, returns immediately
+void ADC_scan_service(void);	// RESRDY handler: stores result and starts the next conversion
+uint8_t ADC_scan_isBusy(void);	// Checks if a scan is still in progress
+void ADC_scan_wait(void);	// Waits for the running scan to finish
+uint8_t ADC_ring_pop(adc_result *result);	// Removes the oldest result from the ring buffer
+void ADC_ring_flush(void);	// Discards all results in the ring buffer
+void ADC_clocked_start(const uint8_t *sequence, uint8_t length, uint16_t rate_hz);	// Converts a channel sequence round robin on the sample clock
+void ADC_clocked_stop(void);	// Stops hardware-timed sampling
+void ADC_monitor_start(uint8_t channel, uint8_t window_mode, int32_t threshold_code,
+					   const uint8_t *capture, uint8_t capture_length);	// Free-runs a channel against a window comparator threshold
+void ADC_monitor_stop(void);	// Stops the window comparator monitor
+void ADC_monitor_service(void);	// WCMP handler: latches the crossing and starts the capture scan
+uint8_t ADC_monitor_isLatched(void);	// Checks if the monitored threshold was crossed
+int32_t ADC_monitor_read(void);	// Latest (or latched) code of the monitored channel
+void fixed_point_scale_init(fixed_point_scale *scale, uint64_t numerator, uint64_t denominator, uint32_t max_code);
+int32_t fixed_point_apply(const fixed_point_scale *scale, int32_t code);	// Applies a precomputed scale factor
+void ADC_reference_init(void);	// Lists the references usable at adc_vref_mv and their scale factors
+void ADC_reference_pin(uint8_t channel, uint8_t ref);	// Puts a channel that does not auto-range on one reference
+void measurement_scales_init(void);	// Precomputes uV, mV-per-cell and mA scale factors
+int32_t load_current_code(int32_t current_ma);	// Shunt channel code at a load current, for thresholds
+uint16_t ADC_code_to_raw(uint8_t channel, int32_t code);	// Normalized code -> ADC0.RES value of a channel
+void ADC_set_oversampling(uint8_t channel, uint8_t sampnum);	// Selects 1 ... 128 accumulated samples for a channel
+uint8_t ADC_effective_bits(uint8_t sampnum);	// Resolution gained by oversampling
+int32_t ADC_code(adc_result result);	// Decodes and decimates a ring buffer result to 1/65536 of VREF
+int32_t ADC_read(adc_result result);	// Converts a ring buffer result to microvolts at the pin
+uint8_t ADC_scan_read_timed(const uint8_t *sequence, uint8_t length, int32_t *codes, uint16_t *timestamps);
+uint8_t ADC_scan_read(const uint8_t *sequence, uint8_t length, int32_t *codes);	// Blocking scan, one code per channel, 0x00 if it came up short
+uint8_t ADC_scan_collect(uint8_t length, int32_t *codes, uint16_t *timestamps);	// Waits for a started scan and decodes it, returns the results popped
+uint16_t batteryCell_read(uint8_t channel); // reads voltage across one battery cell in mV
 void read_UNLOADED_battery_voltages(void);	// reads 4 battery cells and stores in UNLOADED voltages array
+uint8_t read_loaded_snapshot(loaded_snapshot *snapshot);	// time-aligned reading of all cells and load current
+uint8_t collect_loaded_snapshot(loaded_snapshot *snapshot);	// aligns a snapshot scan that is already running
 void read_LOADED_battery_voltages(void);	// reads 4 battery cells and stores in LOADED voltages array
+void collect_LOADED_battery_voltages(void);	// stores the snapshot started by the window comparator
+
+/* ADC self-test Functions -> File Location: "adc_selftest.c" */
+uint8_t ADC_selftest_characterize(void);	// Builds the loopback correction tables, returns failed settings
+int32_t ADC_calibrate_code(const adc_calibration *cal, int32_t code);	// Applies offset, gain and INL correction
+
+/* Measurement statistics Functions -> File Location: "statistics.c" */
+void measurement_stats_init(measurement_stats *stats);	// Clears the running statistics
+void measurement_stats_add(measurement_stats *stats, int32_t sample);	// One pass Welford update
+int32_t measurement_stats_mean(const measurement_stats *stats);	// Mean of the samples
+uint32_t measurement_stats_variance(const measurement_stats *stats);	// Sample variance
+uint8_t measurement_stats_quality(const measurement_stats *stats, uint16_t max_stddev, int32_t low, int32_t high);
+uint32_t integer_sqrt(uint64_t value);	// Floor of the square root, integer only
+
+/* Streaming filter Functions -> File Location: "filter.c" */
+void sample_filter_init(sample_filter *filter, FILTER_TYPE type, uint8_t length);	// Empties a filter and sets its type
+void sample_filter_push(sample_filter *filter, int32_t sample);	// Adds a sample to the window
+int32_t sample_filter_median(const sample_filter *filter);	// Median of the window
+int32_t sample_filter_apply(sample_filter *filter, int32_t sample);	// Adds a sample and returns the filter output
+
+/* Multi-rate scheduler Functions -> File Location: "scheduler.c" */
+uint16_t scheduler_start(void);	// Samples every table class at its own rate on the sample clock
+void scheduler_stop(void);	// Hands the ADC back to the scan sequencer
+uint8_t scheduler_next(void);	// RESRDY handler: picks the channel of the next slot
+void scheduler_store(adc_result result);	// RESRDY handler: keeps a scheduled result
+int32_t scheduler_read(uint8_t channel);	// Latest scheduled code of a channel
+uint32_t scheduler_sample_count(uint8_t channel);	// Scheduled results of a channel, for pacing
+uint16_t scheduler_utilization(void);	// ADC busy time since the start in 1/1000
+
+/* Tap-voltage solver Functions -> File Location: "tap_solver.c" */
+void tap_solver_plan(CELL_STRATEGY strategy, int32_t pack_mv, cell_strategy_plan *plan);	// Predicts noise and scan time
+CELL_STRATEGY tap_solver_select(int32_t pack_mv);	// Sets up the fastest strategy meeting CELL_TARGET_SIGMA_UV
+void tap_solver_release(void);	// Restores the default accumulation of the cell and tap channels
+uint8_t tap_solver_read(int32_t *cell_uv);	// One scan of every cell with the selected strategy, 0x00 if it came up short
+void tap_solver_benchmark(int32_t pack_mv);	// Times and measures both strategies
+void tap_solver_view(void);	// Benchmarks at power-up and shows the result until OK
+
+/* Tap diagnostics Functions -> File Location: "tap_diagnostics.c" */
+TAP_FAULT tap_diagnostics_run(tap_diagnosis *diagnosis);	// Checks every tap before the pack is loaded
+void tap_diagnostics_display(const tap_diagnosis *diagnosis);	// Shows the failed tap on the error screen
+
+/* Timestamp counter Functions -> File Location: "timestamp.c" */
+void timestamp_init(void);	// Starts the free-running TCB1 timestamp counter
+uint16_t timestamp_now(void);	// Reads the timestamp counter
+
+/* Sample clock Functions -> File Location: "sample_clock.c" */
+void sample_clock_start(uint16_t rate_hz);	// RTC overflow event triggers ADC0 conversions at a fixed rate
+void sample_clock_stop(void);	// Stops the sample clock
+uint16_t sample_clock_count(void);	// Number of sample clock events so far
+
+/* Waveform capture Functions -> File Location: "capture.c" */
+void capture_arm(int32_t threshold_code, const uint8_t *kick, uint8_t kick_length);	// Starts a pre-trigger capture
+void capture_abort(void);	// Stops or forgets a capture
+void capture_store(uint8_t index, adc_result result);	// RESRDY handler: stores a sample clock result in the capture
+uint8_t capture_isRunning(void);	// Checks if a capture is recording
+uint8_t capture_isDone(void);	// Checks if the capture is frozen
+int32_t capture_latest_code(uint8_t index);	// Newest value of a capture channel
+void capture_view(PB_INPUT_TYPE pb_type);	// Shows one captured frame on the LCD
+
+/* Stepper motor Functions -> File Location: "stepper_motor.c" */
+void DRV8825_init(void);
+void DRV8825_dir_HIGH(void);
+void DRV8825_dir_LOW(void);
+void stepper_init(void);	// Step timer and acceleration ramp, knob position 0
+void stepper_move(int32_t steps, uint16_t rate_hz);	// Ramped relative move, returns at once
+void stepper_run(int16_t rate_hz);	// Ramped continuous rotation, returns at once
+void stepper_stop(void);	// Ramps down and waits for the knob to stop
+uint8_t stepper_isBusy(void);	// Checks if the knob is turning
+int32_t stepper_position_read(void);	// Knob position in steps
+uint32_t stepper_step_count(void);	// Steps taken since stepper_init()
+void stepper_home(int32_t position);	// Sets the home, the knob is position steps from it
+void stepper_home_lost(void);	// Forgets the home after lost steps
+uint8_t stepper_isHomed(void);	// Checks if the position counts from open circuit
+uint8_t set_load_current(int32_t target_current_ma);	// Closed loop knob positioning, returns 0x01 once settled
+uint8_t load_hold(int32_t target_current_ma, uint16_t duration_ms);	// Constant-current hold, loaded statistics of its end
+uint8_t open_circuit_load(void);	// Fast retract until the current is confirmed zero, 0x00 if stuck
+
+/* Knob map Functions -> File Location: "knob_map.c" */
+uint8_t knob_map_load(void);	// Reads and validates the knob map at boot
+int32_t knob_map_position(int32_t current_ma, int32_t pack_mv);	// Knob position expected to draw a current, -1 without a map
+void knob_map_learn(int32_t position, int32_t current_ma, int32_t pack_mv);	// Refines the map with a settled reading
+uint8_t knob_map_characterize(int32_t max_current_ma, int32_t pack_mv);	// Sweeps the knob and stores a new map
+void knob_map_view(void);	// Power-up sweep screen
+
+/* Load sweep Functions -> File Location: "load_sweep.c" */
+uint8_t load_sweep_run(int32_t max_current_ma);	// Steps the load up to the setting and fits every cell's DC resistance
+void load_sweep_view(void);	// Fitted resistances from cell_page
 
 /* OPAMP and current sensing Functions -> File Location: "opamp.c" */
 void OPAMP_Instrumentation_init(void);
-float get_OPAMP_gain(void);
-float load_current_Read(void);
+uint8_t opamp_gain_calibration_load(void);	// Reads and validates the gain calibration table at boot
+uint8_t opamp_gain_calibration_record(int32_t reference_ma);	// Records an output-versus-gain point
+void opamp_gain_calibration_clear(void);	// Starts a new calibration
+uint8_t opamp_gain_calibration_save(void);	// Writes the recorded points to EEPROM
+uint8_t opamp_auto_zero(void);	// Caches the output offset, load open
+uint16_t opamp_gain_correction(int32_t code);	// Interpolated gain correction at an output code
+uint16_t get_OPAMP_gain(int32_t code);	// Actual gain x 256 at an output code
+int32_t load_current_from_code(int32_t code);	// Gain corrected amplifier output code -> mA
+int32_t load_current_Read(void);
+int16_t temperature_from_code(int32_t code);	// Internal temperature sensor code -> degrees Celsius
+
+/* Calibration FSM Functions -> File Location: "calibration_fsm.c" */
+void calibration_fsm(void);
+void display_calibration_screen(void);
 
 /* Fan Functions -> File Location: "fan.c" */
 void Fan_PWM_init(void);
@@ -205,6 +793,7 @@ void display_test_conditions(test_result result);
 void display_voltage_readings(test_result result);
 void decode_health_rating(test_result result);
 void display_health_ratings(test_result result);
+void scroll_cell_page(PB_INPUT_TYPE pb_type);	// Pages through the cells of packs with more cells than LCD lines
 void display_result_menu(void);
 
 
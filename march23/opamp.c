@@ -0,0 +1,413 @@
+#include "main.h"
+
+int32_t opamp_offset_code;	// amplifier output with the load open, 0 until auto-zeroed
+
+/* Gain calibration in use, validated at boot, and the table being recorded */
+opamp_gain_calibration opamp_gain_cal;
+static int32_t opamp_gain_cal_slope[OPAMP_CAL_POINTS - 1];	// correction per code of every segment
+static opamp_gain_calibration opamp_gain_cal_work;
+
+//***************************************************************************
+//
+// Function Name : "OPAMP_Instrumentation_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// This function configures the 3 internal op amps as an instrumentation
+//  amplifier with a gain defined in the main file
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void OPAMP_Instrumentation_init(void)
+{
+	// DBGRUN disabled;
+	OPAMP.DBGCTRL = 0x0;
+	// Rail-to-Rail voltage ranges;
+	OPAMP.PWRCTRL = 0x00;
+	// OP0 - Input Configuration
+	OPAMP.OP0INMUX = (OPAMP_OP0INMUX_MUXNEG_OUT_gc | OPAMP_OP0INMUX_MUXPOS_INP_gc);
+
+	// OP0 - Resistor Ladder Configuration, default gain is 15
+	switch(OPAMP_gain)
+	{
+		case 15:		
+			OPAMP.OP0RESMUX = (OPAMP_OP0RESMUX_MUXBOT_GND_gc |
+			OPAMP_OP0RESMUX_MUXTOP_OUT_gc | OPAMP_OP0RESMUX_MUXWIP_WIP0_gc);			
+			break;
+			
+		case 7:
+			OPAMP.OP0RESMUX = (OPAMP_OP0RESMUX_MUXBOT_GND_gc |
+			OPAMP_OP0RESMUX_MUXTOP_OUT_gc | OPAMP_OP0RESMUX_MUXWIP_WIP1_gc);
+			break;
+			
+		case 3:
+			OPAMP.OP0RESMUX = (OPAMP_OP0RESMUX_MUXBOT_GND_gc |
+			OPAMP_OP0RESMUX_MUXTOP_OUT_gc | OPAMP_OP0RESMUX_MUXWIP_WIP2_gc);
+			break;	
+			
+		case 1:
+			OPAMP.OP0RESMUX = (OPAMP_OP0RESMUX_MUXBOT_GND_gc |
+			OPAMP_OP0RESMUX_MUXTOP_OUT_gc | OPAMP_OP0RESMUX_MUXWIP_WIP3_gc);
+			break;
+				
+		default: 
+			OPAMP.OP0RESMUX = (OPAMP_OP0RESMUX_MUXBOT_GND_gc |
+			OPAMP_OP0RESMUX_MUXTOP_OUT_gc | OPAMP_OP0RESMUX_MUXWIP_WIP0_gc);
+	}
+
+	// OP1 - Input Configuration
+	OPAMP.OP1INMUX = (OPAMP_OP1INMUX_MUXNEG_OUT_gc | OPAMP_OP1INMUX_MUXPOS_INP_gc);
+
+	// OP1 - Resistor Ladder Configuration
+	OPAMP.OP1RESMUX = (OPAMP_OP1RESMUX_MUXBOT_OFF_gc |
+	OPAMP_OP1RESMUX_MUXTOP_OFF_gc | OPAMP_OP1RESMUX_MUXWIP_WIP0_gc);
+
+	// OP2 - Input Configuration
+	OPAMP.OP2INMUX = (OPAMP_OP2INMUX_MUXNEG_WIP_gc |
+	OPAMP_OP2INMUX_MUXPOS_LINKWIP_gc);
+
+	// OP2 - Resistor Ladder Configuration, default gain is 15
+	switch(OPAMP_gain)
+	{
+		case 15:
+		OPAMP.OP2RESMUX = (OPAMP_OP2RESMUX_MUXBOT_LINKOUT_gc |
+		OPAMP_OP2RESMUX_MUXTOP_OUT_gc | OPAMP_OP2RESMUX_MUXWIP_WIP7_gc);
+		break;
+		
+		case 7:
+		OPAMP.OP2RESMUX = (OPAMP_OP2RESMUX_MUXBOT_LINKOUT_gc |
+		OPAMP_OP2RESMUX_MUXTOP_OUT_gc | OPAMP_OP2RESMUX_MUXWIP_WIP6_gc);
+		break;
+		
+		case 3:
+		OPAMP.OP2RESMUX = (OPAMP_OP2RESMUX_MUXBOT_LINKOUT_gc |
+		OPAMP_OP2RESMUX_MUXTOP_OUT_gc | OPAMP_OP2RESMUX_MUXWIP_WIP5_gc);		
+		break;
+		
+		case 1:
+		OPAMP.OP2RESMUX = (OPAMP_OP2RESMUX_MUXBOT_LINKOUT_gc |
+		OPAMP_OP2RESMUX_MUXTOP_OUT_gc | OPAMP_OP2RESMUX_MUXWIP_WIP3_gc);
+		break;
+		
+		default:
+		OPAMP.OP2RESMUX = (OPAMP_OP2RESMUX_MUXBOT_LINKOUT_gc |
+		OPAMP_OP2RESMUX_MUXTOP_OUT_gc | OPAMP_OP2RESMUX_MUXWIP_WIP7_gc);
+	}	
+
+	//ALWAYSON enabled; EVENTEN disabled; OUTMODE Output Driver in Normal Mode; RUNSTBY enabled;
+	OPAMP.OP0CTRLA = 0x85;
+	OPAMP.OP1CTRLA = 0x85;
+	OPAMP.OP2CTRLA = 0x85;
+
+	// SETTLE 127;
+	OPAMP.OP0SETTLE = 0x7F;
+	OPAMP.OP1SETTLE = 0x7F;
+	OPAMP.OP2SETTLE = 0x7F;
+
+	// Enable
+	OPAMP.CTRLA |= OPAMP_ENABLE_bm;
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_calibration_prepare"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Precomputes the slope of every segment of the calibration table in
+//	OPAMP_CAL_SLOPE_SHIFT fixed point, so the lookup needs no division.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void opamp_gain_calibration_prepare(void)
+{
+	for (uint8_t i = 0; i + 1 < opamp_gain_cal.count; i++)
+	{
+		int32_t rise = (int32_t)opamp_gain_cal.correction[i + 1] - opamp_gain_cal.correction[i];
+		int32_t run = (int32_t)opamp_gain_cal.code[i + 1] - opamp_gain_cal.code[i];
+		opamp_gain_cal_slope[i] = (rise * ((int32_t)1 << OPAMP_CAL_SLOPE_SHIFT)) / run;
+	}
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_calibration_load"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Reads the gain calibration table from EEPROM and checks it before it
+//	is used: magic number, checksum, number of points, breakpoints in
+//	strictly increasing order, corrections within 0.5 ... 2.0 and the
+//	table recorded at the gain the amplifier is configured for. An
+//	invalid table is ignored and the nominal gain is used. Called once at
+//	boot.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t valid: 0x01 if the table is used, 0x00 if the nominal gain is used
+//
+//**************************************************************************
+uint8_t opamp_gain_calibration_load(void)
+{
+	uint8_t valid;
+
+	eeprom_read_block(&opamp_gain_cal, &opamp_gain_calibration_eeprom, sizeof(opamp_gain_calibration));
+
+	valid = (opamp_gain_cal.magic == OPAMP_CAL_MAGIC)
+			&& (eeprom_block_checksum(&opamp_gain_cal, sizeof(opamp_gain_calibration) - 1) == opamp_gain_cal.checksum)
+			&& (opamp_gain_cal.count >= 1) && (opamp_gain_cal.count <= OPAMP_CAL_POINTS)
+			&& (opamp_gain_cal.gain == OPAMP_gain);
+
+	for (uint8_t i = 0; valid && i < opamp_gain_cal.count; i++)
+	{
+		if (opamp_gain_cal.correction[i] < (OPAMP_CAL_ONE / 2) || opamp_gain_cal.correction[i] > (OPAMP_CAL_ONE * 2))
+			valid = 0x00;
+		if (i > 0 && opamp_gain_cal.code[i] <= opamp_gain_cal.code[i - 1])
+			valid = 0x00;
+	}
+
+	if (!valid)
+		opamp_gain_cal.count = 0;	// lookup falls back to the nominal gain
+	opamp_gain_calibration_prepare();
+	return valid;
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_calibration_record"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Records one output-versus-gain point while a known reference current
+//	flows through the shunt. The amplifier output is measured with 64x
+//	oversampling and compared with the output the nominal gain would
+//	give, the ratio is the gain correction at that output level. The
+//	table in use is set aside while measuring so the reading is
+//	uncorrected. Points are kept sorted by output code, a point close to
+//	an existing one replaces it. The table is only used after it is saved.
+//
+// Inputs :
+//		int32_t reference_ma: load current set by the reference, in milliamps
+//
+// Outputs :
+//		uint8_t points: number of points recorded so far, 0 if the reading
+//						was too low, short or the correction implausible
+//
+//**************************************************************************
+uint8_t opamp_gain_calibration_record(int32_t reference_ma)
+{
+	uint8_t sampnum = adc_channel_table[ADC_CH_LOAD_CURRENT].sampnum;
+	int32_t measured, expected;
+	uint32_t correction;
+	uint8_t i, complete, table_count = opamp_gain_cal.count;
+
+	/* Oversample for the calibration reading, uncorrected, then restore the settings */
+	ADC_set_oversampling(ADC_CH_LOAD_CURRENT, ADC_SAMPNUM_ACC64_gc);
+	opamp_gain_cal.count = 0;
+	complete = ADC_scan_read(adc_scan_load_current, 1, &measured);
+	opamp_gain_cal.count = table_count;
+	ADC_set_oversampling(ADC_CH_LOAD_CURRENT, sampnum);
+
+	expected = load_current_code(reference_ma);
+	if (!complete || measured < OPAMP_CAL_MIN_CODE || measured > 0xFFFF || expected <= 0)
+		return 0x00;
+
+	correction = ((uint32_t)expected * OPAMP_CAL_ONE + ((uint32_t)measured >> 1)) / (uint32_t)measured;
+	if (correction < (OPAMP_CAL_ONE / 2) || correction > (OPAMP_CAL_ONE * 2))
+		return 0x00;
+
+	/* Replace a point within OPAMP_CAL_MIN_CODE of this one, otherwise insert in order */
+	for (i = 0; i < opamp_gain_cal_work.count; i++)
+	{
+		if (labs((int32_t)opamp_gain_cal_work.code[i] - measured) < OPAMP_CAL_MIN_CODE)
+		{
+			opamp_gain_cal_work.code[i] = (uint16_t)measured;
+			opamp_gain_cal_work.correction[i] = (uint16_t)correction;
+			return opamp_gain_cal_work.count;
+		}
+		if (opamp_gain_cal_work.code[i] > measured)
+			break;
+	}
+	if (opamp_gain_cal_work.count >= OPAMP_CAL_POINTS)
+		return 0x00;
+
+	for (uint8_t j = opamp_gain_cal_work.count; j > i; j--)
+	{
+		opamp_gain_cal_work.code[j] = opamp_gain_cal_work.code[j - 1];
+		opamp_gain_cal_work.correction[j] = opamp_gain_cal_work.correction[j - 1];
+	}
+	opamp_gain_cal_work.code[i] = (uint16_t)measured;
+	opamp_gain_cal_work.correction[i] = (uint16_t)correction;
+	opamp_gain_cal_work.count++;
+	return opamp_gain_cal_work.count;
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_calibration_clear"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Starts a new calibration: empties the table that
+//	opamp_gain_calibration_record() fills.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void opamp_gain_calibration_clear(void)
+{
+	opamp_gain_cal_work.count = 0;
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_calibration_save"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Stores the recorded points in EEPROM with magic number and checksum
+//	and reloads them, so the new table is validated the same way as at
+//	boot. Nothing is written if no point was recorded.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t valid: 0x01 if the saved table is in use
+//
+//**************************************************************************
+uint8_t opamp_gain_calibration_save(void)
+{
+	if (opamp_gain_cal_work.count == 0)
+		return 0x00;
+
+	opamp_gain_cal_work.gain = OPAMP_gain;
+	opamp_gain_cal_work.magic = OPAMP_CAL_MAGIC;
+	opamp_gain_cal_work.checksum = eeprom_block_checksum(&opamp_gain_cal_work, sizeof(opamp_gain_calibration) - 1);
+	eeprom_update_block(&opamp_gain_cal_work, &opamp_gain_calibration_eeprom, sizeof(opamp_gain_calibration));
+	return opamp_gain_calibration_load();
+}
+//***************************************************************************
+//
+// Function Name : "opamp_gain_correction"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Looks up the gain correction for an amplifier output code. The segment
+//	is found by binary search over the breakpoints and the correction is
+//	linearly interpolated with the precomputed slope, integer math only.
+//	Outside the calibrated range the nearest end point is used, without a
+//	valid table the correction is 1.
+//
+// Inputs :
+//		int32_t code: amplifier output in 1/65536 of VREF
+//
+// Outputs :
+//		uint16_t correction: nominal gain / actual gain, OPAMP_CAL_ONE = 1.0
+//
+//**************************************************************************
+uint16_t opamp_gain_correction(int32_t code)
+{
+	uint8_t count = opamp_gain_cal.count;
+	uint8_t low = 0, high;
+
+	if (count == 0)
+		return OPAMP_CAL_ONE;
+	if (code <= opamp_gain_cal.code[0])
+		return opamp_gain_cal.correction[0];
+	if (code >= opamp_gain_cal.code[count - 1])
+		return opamp_gain_cal.correction[count - 1];
+
+	/* Find the segment code[low] <= code < code[low + 1] */
+	high = count - 1;
+	while (high - low > 1)
+	{
+		uint8_t middle = (low + high) >> 1;
+		if (code < opamp_gain_cal.code[middle])
+			high = middle;
+		else
+			low = middle;
+	}
+
+	return opamp_gain_cal.correction[low]
+		   + (int16_t)((opamp_gain_cal_slope[low] * (code - opamp_gain_cal.code[low])) >> OPAMP_CAL_SLOPE_SHIFT);
+}
+//***************************************************************************
+//
+// Function Name : "get_OPAMP_gain"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  The gain of the instrumentation amplifier is not exactly the value
+//   that is programmed. The calibration table of output voltage versus
+//	 gain is used to calculate the actual gain at an output level.
+//
+// Inputs :
+//		int32_t code: amplifier output in 1/65536 of VREF
+//
+// Outputs : 
+//		uint16_t gain: Actual gain of instrumentation amplifier x 256
+//
+//**************************************************************************
+uint16_t get_OPAMP_gain(int32_t code)
+{
+	return (uint16_t)(((uint32_t)OPAMP_gain * 256 * OPAMP_CAL_ONE) / opamp_gain_correction(code));
+}
+//***************************************************************************
+//
+// Function Name : "load_current_from_code"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Converts an amplifier output code to the load current, scaled by the
+//	precomputed divider, nominal gain and shunt factor. ADC_code() already
+//	removed the auto-zero offset and corrected the calibrated gain error.
+//
+// Inputs :
+//		int32_t code: amplifier output in 1/65536 of VREF
+//
+// Outputs :
+//		int32_t current: Load current through shunt in milliamps
+//
+//**************************************************************************
+int32_t load_current_from_code(int32_t code)
+{
+	return fixed_point_apply(&load_current_scale_ma, code);
+}
+//***************************************************************************
+//
+// Function Name : "opamp_auto_zero"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+//  Measures the output offset of the amplifier while the load is known
+//	to be open, with 64x oversampling, and caches it in opamp_offset_code
+//	for ADC_code() to subtract. A few millivolts of offset are tens of
+//	amps on the 80uOhm shunt. An offset above OPAMP_ZERO_MAX_MA means
+//	current is flowing, the offset of the previous auto-zero is kept. The
+//	ADC cannot see a negative offset, it reads as 0.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t zeroed: 0x01 if the offset was measured, 0x00 if the old one was kept
+//
+//**************************************************************************
+uint8_t opamp_auto_zero(void)
+{
+	uint8_t sampnum = adc_channel_table[ADC_CH_LOAD_CURRENT].sampnum;
+	int32_t limit = load_current_code(OPAMP_ZERO_MAX_MA);
+	uint8_t zeroed = 0x01, table_count = opamp_gain_cal.count;
+	int32_t previous = opamp_offset_code;
+	int32_t offset;
+
+	/* The offset is removed before the gain calibration is applied, it is read without either */
+	opamp_gain_cal.count = 0;
+	opamp_offset_code = 0;
+	ADC_set_oversampling(ADC_CH_LOAD_CURRENT, ADC_SAMPNUM_ACC64_gc);
+
+	if (!ADC_scan_read(adc_scan_load_current, 1, &offset) || offset > limit)
+	{
+		opamp_offset_code = previous;
+		zeroed = 0x00;
+	}
+	else
+		opamp_offset_code = offset;
+
+	ADC_set_oversampling(ADC_CH_LOAD_CURRENT, sampnum);
+	opamp_gain_cal.count = table_count;
+	return zeroed;
+}
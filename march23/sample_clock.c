@@ -0,0 +1,94 @@
+#include "main.h"
+
+//***************************************************************************
+//
+// Function Name : "sample_clock_start"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Starts the hardware sample clock. The RTC counts the internal 32.768kHz
+// oscillator and its overflow event is routed through event channel 0 to
+// the ADC0 start input, so conversions start at a fixed rate without any
+// CPU involvement. The same event clocks TCB2 as a trigger counter, which
+// gives every sample a sequence number. The rate is rounded to a whole
+// number of RTC ticks, the period actually used is kept in
+// sample_clock_period.
+//
+// Inputs :
+//		uint16_t rate_hz: samples per second, 1 ... SAMPLE_CLOCK_MAX_HZ
+//
+// Outputs : none
+//
+//**************************************************************************
+void sample_clock_start(uint16_t rate_hz)
+{
+	if (rate_hz == 0)
+		rate_hz = 1;
+	else if (rate_hz > SAMPLE_CLOCK_MAX_HZ)
+		rate_hz = SAMPLE_CLOCK_MAX_HZ;
+	sample_clock_period = (uint16_t)((RTC_CLOCK_HZ + (rate_hz >> 1)) / rate_hz);
+
+	/* Stop the RTC and wait for the registers to synchronize before changing the period */
+	RTC.CTRLA = 0x00;
+	while (RTC.STATUS & RTC_CTRLABUSY_bm);
+	RTC.CLKSEL = RTC_CLKSEL_OSC32K_gc;	// Internal 32.768kHz oscillator
+	while (RTC.STATUS & (RTC_PERBUSY_bm | RTC_CNTBUSY_bm));
+	RTC.PER = sample_clock_period - 1;	// Overflow once per sample period
+	RTC.CNT = 0;
+
+	/* TCB2 counts sample clock events, read through sample_clock_count() */
+	TCB2.CTRLA = 0x00;
+	TCB2.CNT = 0;
+	TCB2.CCMP = 0xFFFF;
+	TCB2.CTRLB = TCB_CNTMODE_INT_gc;
+
+	/* RTC overflow -> channel 0 -> ADC0 start and TCB2 count */
+	EVSYS.CHANNEL0 = EVSYS_CHANNEL0_RTC_OVF_gc;
+	EVSYS.USERADC0START = EVSYS_USER_CHANNEL0_gc;
+	EVSYS.USERTCB2COUNT = EVSYS_USER_CHANNEL0_gc;
+
+	TCB2.CTRLA = (TCB_CLKSEL_EVENT_gc | TCB_ENABLE_bm);
+	while (RTC.STATUS & (RTC_PERBUSY_bm | RTC_CNTBUSY_bm | RTC_CTRLABUSY_bm));
+	RTC.CTRLA = (RTC_PRESCALER_DIV1_gc | RTC_RTCEN_bm);
+}
+//***************************************************************************
+//
+// Function Name : "sample_clock_stop"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Stops the RTC and disconnects the sample clock event from its users.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void sample_clock_stop(void)
+{
+	RTC.CTRLA = 0x00;
+	EVSYS.USERADC0START = 0x00;
+	EVSYS.USERTCB2COUNT = 0x00;
+	TCB2.CTRLA = 0x00;
+}
+//***************************************************************************
+//
+// Function Name : "sample_clock_count"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Reads the number of sample clock events since sample_clock_start(). The
+// 16-bit read goes through the shared TEMP register, so it is done with
+// interrupts masked in case the ADC ISR reads the counter at the same time.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint16_t count: sample clock events, wraps at 2^16
+//
+//**************************************************************************
+uint16_t sample_clock_count(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t count = TCB2.CNT;
+	SREG = sreg;
+	return count;
+}
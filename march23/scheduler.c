@@ -0,0 +1,286 @@
+#include "main.h"
+
+/* Channel lists of the scheduled signal classes */
+static const uint8_t schedule_current_channels[1] = {ADC_CH_LOAD_CURRENT};
+static const uint8_t schedule_temperature_channels[1] = {ADC_CH_TEMPERATURE};
+
+/* Multi-rate sampling table, indexed by SCHEDULE_CLASS_ID. The rate applies to every channel of a
+   class, classes are listed by priority: the first one due wins a slot */
+const schedule_class adc_schedule_table[SCHEDULE_CLASS_COUNT] = {
+	/* channels,						count, rate */
+	{schedule_current_channels,		1, 500},	// SCHEDULE_CURRENT: shunt amplifier, load control
+	{adc_scan_cells,	PACK_CELL_COUNT, 50},		// SCHEDULE_CELLS: cell taps, sag tracking
+	{schedule_temperature_channels,	1, 2}		// SCHEDULE_TEMPERATURE: die temperature, ambient estimate
+};
+schedule_stats adc_schedule_statistics[SCHEDULE_CLASS_COUNT];
+
+/* Scheduler state, shared between the ADC RESRDY ISR and the consumers */
+static uint32_t schedule_period_q8[SCHEDULE_CLASS_COUNT];	// slots between samples of a class, 8 fraction bits
+static uint32_t schedule_due_q8[SCHEDULE_CLASS_COUNT];		// slot the next sample of a class is due in
+static uint8_t schedule_channel_index[SCHEDULE_CLASS_COUNT];	// next channel of a class
+static volatile uint32_t schedule_slot;			// slot being decided by scheduler_next()
+static volatile uint32_t schedule_idle_slots;	// slots with no class due
+static volatile uint8_t schedule_pending;		// class of the conversion in flight, SCHEDULE_IDLE for none
+static volatile uint8_t schedule_last_channel;	// channel kept selected through idle slots
+static uint16_t schedule_slot_ticks;			// RTC ticks per slot
+static volatile adc_result schedule_latest[ADC_CHANNEL_COUNT];	// newest result of every channel
+static volatile uint32_t schedule_channel_samples[ADC_CHANNEL_COUNT];	// results per channel
+
+//***************************************************************************
+//
+// Function Name : "scheduler_start"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Samples every class of adc_schedule_table at its own rate on the single
+// ADC. The sample clock runs at the total demand plus 1/SCHEDULE_HEADROOM
+// spare slots, and every slot goes to the class whose sample is the most
+// overdue, ties to the earlier table entry. The jitter of a sample stays
+// within about one slot per class (see adc_schedule_statistics), and a
+// class keeps its average rate because its next due time advances by its period rather
+// than from when it was served. The spare slots let late classes catch up.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint16_t slot_rate_hz: sample clock rate, 0 if the table asks for more than the ADC can do
+//
+//**************************************************************************
+uint16_t scheduler_start(void)
+{
+	uint32_t demand_hz = 0;
+	uint32_t slot_hz;
+
+	for (uint8_t i = 0; i < SCHEDULE_CLASS_COUNT; i++)
+		demand_hz += (uint32_t)adc_schedule_table[i].count * adc_schedule_table[i].rate_hz;
+	slot_hz = demand_hz + (demand_hz + SCHEDULE_HEADROOM - 1) / SCHEDULE_HEADROOM;
+	if (slot_hz == 0 || slot_hz > SAMPLE_CLOCK_MAX_HZ)
+		return 0;
+
+	/* Same rounding as sample_clock_start(), the periods are counted in real slots */
+	schedule_slot_ticks = (uint16_t)((RTC_CLOCK_HZ + (slot_hz >> 1)) / slot_hz);
+
+	for (uint8_t i = 0; i < SCHEDULE_CLASS_COUNT; i++)
+	{
+		const schedule_class *entry = &adc_schedule_table[i];
+		schedule_period_q8[i] = (uint32_t)((RTC_CLOCK_HZ << 8) / ((uint32_t)entry->rate_hz * entry->count * schedule_slot_ticks));
+		schedule_due_q8[i] = 0;	// everything is due in the first slots
+		schedule_channel_index[i] = 0;
+		adc_schedule_statistics[i].samples = 0;
+		adc_schedule_statistics[i].max_lateness = 0;
+		adc_schedule_statistics[i].overruns = 0;
+	}
+	for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++)
+		schedule_channel_samples[i] = 0;
+	schedule_slot = 0;
+	schedule_idle_slots = 0;
+	schedule_pending = SCHEDULE_IDLE;
+	schedule_last_channel = adc_schedule_table[0].channels[0];
+
+	ADC_clocked_start(NULL, 0, (uint16_t)slot_hz);
+	return (uint16_t)slot_hz;
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_stop"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Stops the scheduler and hands the ADC back to the scan sequencer. The
+// latest results and statistics stay readable.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void scheduler_stop(void)
+{
+	ADC_clocked_stop();
+	schedule_pending = SCHEDULE_IDLE;
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_next"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Called from the ADC RESRDY interrupt once per slot, decides which channel
+// the next sample clock event converts. Cost is one pass over the class
+// table. A class that fell a whole period behind on top of the normal
+// one slot per class of jitter restarts from the current slot and counts
+// an overrun instead of bursting to catch up.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t channel: channel ID to select for the next event
+//
+//**************************************************************************
+uint8_t scheduler_next(void)
+{
+	uint32_t now_q8 = schedule_slot << 8;
+	uint8_t chosen = SCHEDULE_IDLE;
+	int32_t most_late = -1;
+
+	schedule_slot++;
+
+	for (uint8_t i = 0; i < SCHEDULE_CLASS_COUNT; i++)
+	{
+		int32_t late = (int32_t)(now_q8 - schedule_due_q8[i]);
+		if (late > most_late)
+		{
+			most_late = late;
+			chosen = i;
+		}
+	}
+
+	if (chosen == SCHEDULE_IDLE)
+	{
+		schedule_idle_slots++;
+		schedule_pending = SCHEDULE_IDLE;
+		return schedule_last_channel;	// nothing due, the idle result is dropped
+	}
+
+	schedule_stats *stats = &adc_schedule_statistics[chosen];
+	const schedule_class *entry = &adc_schedule_table[chosen];
+	uint16_t late_slots = (uint16_t)(most_late >> 8);
+
+	if (late_slots > stats->max_lateness)
+		stats->max_lateness = late_slots;
+	if ((uint32_t)most_late >= schedule_period_q8[chosen] + ((uint32_t)SCHEDULE_CLASS_COUNT << 8))
+	{
+		stats->overruns++;
+		schedule_due_q8[chosen] = now_q8 + schedule_period_q8[chosen];
+	}
+	else
+		schedule_due_q8[chosen] += schedule_period_q8[chosen];
+
+	schedule_last_channel = entry->channels[schedule_channel_index[chosen]];
+	schedule_channel_index[chosen] = (schedule_channel_index[chosen] + 1 < entry->count) ? schedule_channel_index[chosen] + 1 : 0;
+	schedule_pending = chosen;
+	return schedule_last_channel;
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_store"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Called from the ADC RESRDY interrupt with the result of a scheduled
+// slot. Keeps it as the latest result of its channel, results of idle
+// slots are dropped.
+//
+// Inputs :
+//		adc_result result: the conversion result
+//
+// Outputs : none
+//
+//**************************************************************************
+void scheduler_store(adc_result result)
+{
+	if (schedule_pending == SCHEDULE_IDLE)
+		return;
+
+	schedule_latest[result.channel] = result;
+	schedule_channel_samples[result.channel]++;
+	adc_schedule_statistics[schedule_pending].samples++;
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Latest scheduled result of a channel, decoded. The result is copied
+// with interrupts masked so it is not torn by the ADC interrupt.
+//
+// Inputs :
+//		uint8_t channel: channel ID of a scheduled class
+//
+// Outputs :
+//		int32_t code: result in 1/65536 of VREF, 0 before the first sample
+//
+//**************************************************************************
+int32_t scheduler_read(uint8_t channel)
+{
+	adc_result result;
+	uint32_t samples;
+	uint8_t sreg = SREG;
+
+	cli();
+	result = schedule_latest[channel];
+	samples = schedule_channel_samples[channel];
+	SREG = sreg;
+
+	if (samples == 0)
+		return 0;
+	return ADC_code(result);
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_sample_count"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Results of a channel since scheduler_start(). A consumer that runs once
+// per sample waits for the count to change, the sample clock then paces
+// it. Copied with interrupts masked.
+//
+// Inputs :
+//		uint8_t channel: channel ID of a scheduled class
+//
+// Outputs :
+//		uint32_t samples: scheduled results of the channel
+//
+//**************************************************************************
+uint32_t scheduler_sample_count(uint8_t channel)
+{
+	uint32_t samples;
+	uint8_t sreg = SREG;
+
+	cli();
+	samples = schedule_channel_samples[channel];
+	SREG = sreg;
+	return samples;
+}
+//***************************************************************************
+//
+// Function Name : "scheduler_utilization"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Fraction of the time the ADC spent converting since scheduler_start().
+// The conversion time of a channel follows from its accumulation and
+// sample length, (SAMPLEN + ADC_CONVERSION_CLOCKS) ADC clocks per
+// sample, and is weighed by the number of results of the channel.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint16_t utilization: busy time in 1/1000 of the elapsed time
+//
+//**************************************************************************
+uint16_t scheduler_utilization(void)
+{
+	uint64_t busy_adc_clocks = 0;
+	uint64_t elapsed_adc_clocks;
+	uint32_t slots;
+	uint8_t sreg = SREG;
+
+	cli();
+	slots = schedule_slot;
+	SREG = sreg;
+	if (slots == 0)
+		return 0;
+
+	for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++)
+	{
+		const adc_channel_descriptor *desc = &adc_channel_table[i];
+		uint32_t clocks = (uint32_t)(ADC_CONVERSION_CLOCKS + desc->samplen) << (desc->sampnum & ADC_SAMPNUM_gm);
+
+		sreg = SREG;
+		cli();
+		busy_adc_clocks += (uint64_t)schedule_channel_samples[i] * clocks;
+		SREG = sreg;
+	}
+
+	/* Slot length in ADC clocks: RTC ticks * (F_CPU / ADC prescaler) / RTC clock */
+	elapsed_adc_clocks = (uint64_t)slots * schedule_slot_ticks * (F_CPU / ADC_PRESCALER) / RTC_CLOCK_HZ;
+	if (busy_adc_clocks >= elapsed_adc_clocks)
+		return 1000;
+	return (uint16_t)(busy_adc_clocks * 1000 / elapsed_adc_clocks);
+}
@@ -99,9 +99,9 @@ void settings_menu_OK(void)
 {
 	switch(cursor)
 	{
-		/* LCD line 1: Toggle Test mode between manual and automated */
+		/* LCD line 1: Cycle Test mode through manual, automated and sweep */
 		case 1:
-			testing_mode ^= 0x01;	// XOR operation to toggle lsb
+			testing_mode = (testing_mode >= 0x02) ? 0x00 : testing_mode + 1;
 			display_settings_menu();
 			break;
 		/* LCD line 2: New screen to set load current */
@@ -280,6 +280,7 @@ void display_settings_menu(void)
 	clear_lcd();
 	if (testing_mode == 0x00)	   {sprintf(dsp_buff[0], "Mode: Manual        ");}
 	else if (testing_mode == 0x01) {sprintf(dsp_buff[0], "Mode: Automated     ");}
+	else if (testing_mode == 0x02) {sprintf(dsp_buff[0], "Mode: Sweep         ");}
 	sprintf(dsp_buff[1], "Load Current:%uA    " , current_setting);
 	sprintf(dsp_buff[2], "Voltage DP:%u       ", voltage_precision);	// Decimal Point (DP)
 	sprintf(dsp_buff[3], "Battery Type: Li-Ion");	// feature unavailable, default is Li-Ion....
@@ -0,0 +1,156 @@
+#include "main.h"
+
+//***************************************************************************
+//
+// Function Name : "measurement_stats_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Clears the running statistics of a measurement before its first sample.
+//
+// Inputs :
+//		measurement_stats *stats: statistics to clear
+//
+// Outputs : none
+//
+//**************************************************************************
+void measurement_stats_init(measurement_stats *stats)
+{
+	stats->count = 0;
+	stats->mean_q8 = 0;
+	stats->m2_q16 = 0;
+	stats->min = INT32_MAX;
+	stats->max = INT32_MIN;
+}
+//***************************************************************************
+//
+// Function Name : "measurement_stats_add"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Adds one sample to the running statistics in a single pass, Welford's
+// update in integer form. The mean carries 8 fraction bits so the small
+// steps of late samples are not lost, the sum of squared deviations
+// carries 16.
+//
+// Inputs :
+//		measurement_stats *stats: running statistics
+//		int32_t sample: new sample, |sample| < 2^23
+//
+// Outputs : none
+//
+//**************************************************************************
+void measurement_stats_add(measurement_stats *stats, int32_t sample)
+{
+	int32_t sample_q8 = sample * 256;
+	int32_t delta = sample_q8 - stats->mean_q8;
+
+	stats->count++;
+	stats->mean_q8 += delta / (int32_t)stats->count;
+	stats->m2_q16 += (int64_t)delta * (sample_q8 - stats->mean_q8);
+
+	if (sample < stats->min)
+		stats->min = sample;
+	if (sample > stats->max)
+		stats->max = sample;
+}
+//***************************************************************************
+//
+// Function Name : "measurement_stats_mean"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Mean of the samples, rounded to the units of the samples.
+//
+// Inputs :
+//		const measurement_stats *stats: running statistics
+//
+// Outputs :
+//		int32_t mean: mean of all samples added so far
+//
+//**************************************************************************
+int32_t measurement_stats_mean(const measurement_stats *stats)
+{
+	return (stats->mean_q8 + 128) >> 8;
+}
+//***************************************************************************
+//
+// Function Name : "measurement_stats_variance"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Sample variance, in the units of the samples squared.
+//
+// Inputs :
+//		const measurement_stats *stats: running statistics
+//
+// Outputs :
+//		uint32_t variance: 0 with less than 2 samples
+//
+//**************************************************************************
+uint32_t measurement_stats_variance(const measurement_stats *stats)
+{
+	if (stats->count < 2 || stats->m2_q16 <= 0)
+		return 0;
+	return (uint32_t)((stats->m2_q16 / (stats->count - 1)) >> 16);
+}
+//***************************************************************************
+//
+// Function Name : "measurement_stats_quality"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Judges a measurement from its statistics. It is noisy when the standard
+// deviation exceeds the limit (compared as variance, no square root) and
+// out of range when any sample left the plausible window.
+//
+// Inputs :
+//		const measurement_stats *stats: running statistics
+//		uint16_t max_stddev: largest acceptable standard deviation
+//		int32_t low, high: plausible sample range
+//
+// Outputs :
+//		uint8_t quality: MEASUREMENT_OK or MEASUREMENT_NOISY | MEASUREMENT_OUT_OF_RANGE
+//
+//**************************************************************************
+uint8_t measurement_stats_quality(const measurement_stats *stats, uint16_t max_stddev, int32_t low, int32_t high)
+{
+	uint8_t quality = MEASUREMENT_OK;
+
+	if (measurement_stats_variance(stats) > (uint32_t)max_stddev * max_stddev)
+		quality |= MEASUREMENT_NOISY;
+	if (stats->count == 0 || stats->min < low || stats->max > high)
+		quality |= MEASUREMENT_OUT_OF_RANGE;
+	return quality;
+}
+//***************************************************************************
+//
+// Function Name : "integer_sqrt"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Integer square root by the bitwise method, one pass per result bit and
+// no float. Turns variances back into standard deviations, and builds the
+// stepper ramp from squared times.
+//
+// Inputs :
+//		uint64_t value: radicand
+//
+// Outputs :
+//		uint32_t root: largest integer whose square is at most value
+//
+//**************************************************************************
+uint32_t integer_sqrt(uint64_t value)
+{
+	uint64_t root = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > value)
+		bit >>= 2;
+	while (bit != 0)
+	{
+		if (value >= root + bit)
+		{
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+		bit >>= 2;
+	}
+	return (uint32_t)root;
+}
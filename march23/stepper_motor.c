@@ -1,5 +1,17 @@
 #include "main.h"
-#define STEP_PERIOD_US 10	// 10us STEP period => 100kHz STEP frequency
+
+/* Step generator state, shared between the TCB0 ISR and the consumers */
+static uint16_t stepper_ramp[STEPPER_RAMP_LENGTH];	// TCB0 ticks before step k + 1 when accelerating from rest
+static volatile STEPPER_MODE stepper_mode;
+static volatile int32_t stepper_position;	// Knob position in steps, clockwise positive
+static volatile int32_t stepper_target;		// Position a STEPPER_MOVE ends at
+static volatile int8_t stepper_run_direction;	// Direction of STEPPER_RUN, 0 to stop
+static volatile uint16_t stepper_cruise;	// Interval of the commanded rate in TCB0 ticks
+static volatile int8_t stepper_direction;	// Direction the knob is turning, 0 when stopped
+static volatile uint16_t stepper_ramp_index;	// Ramp entry at or just above the current speed
+static volatile uint16_t stepper_interval;	// TCB0 ticks of the step being timed
+static volatile uint32_t stepper_steps;		// Steps taken since stepper_init()
+static uint8_t stepper_homed;	// 0x01 once the position counts from open circuit
 
 //***************************************************************************
 //
@@ -21,118 +33,825 @@ void DRV8825_init(void)
 }
 //***************************************************************************
 //
-// Function Name : "DRV8825_step"
+// Function Name : "DRV8825_dir_HIGH"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Triggers a rising edge pulse to step the DRV8825
+// Sets the DIR pin to HIGH for the stepper motor direction
 //
 // Inputs : none
 //
 // Outputs : none
 //
 //**************************************************************************
-void DRV8825_step(void)
+void DRV8825_dir_HIGH(void)
 {	
-	PORTC.OUT |= PIN4_bm;			// Rising edge on STEP pin
-	_delay_us(0.5*STEP_PERIOD_US);	// delay for half PERIOD
-	PORTC.OUT &= ~PIN4_bm;			// Falling edge on STEP pin
-	_delay_us(0.5*STEP_PERIOD_US);	// delay for half PERIOD
+	PORTC.OUTSET = PIN5_bm;	// Single write, the step ISR toggles PC4 meanwhile
 }
+
 //***************************************************************************
 //
-// Function Name : "DRV8825_dir_HIGH"
+// Function Name : "DRV8825_dir_LOW"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Sets the DIR pin to HIGH for the stepper motor direction
+// Sets the DIR pin to LOW for the stepper motor direction
 //
 // Inputs : none
 //
 // Outputs : none
 //
 //**************************************************************************
-void DRV8825_dir_HIGH(void)
+void DRV8825_dir_LOW(void)
 {	
-	PORTC.OUT |= PIN5_bm;
+	PORTC.OUTCLR = PIN5_bm;
 }
 
 //***************************************************************************
 //
-// Function Name : "DRV8825_dir_LOW"
+// Function Name : "stepper_init"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Sets the DIR pin to LOW for the stepper motor direction
+// Sets up the timer driven step generator. TCB0 runs in periodic interrupt
+//	mode at CLK_PER/2 and every compare is one STEP pulse, CCMP holds the
+//	time to the next one. The ramp table holds the exact step intervals of
+//	a constant STEPPER_ACCEL_HZ_PER_S acceleration from rest, step k is
+//	taken at sqrt(2k / a), up to STEPPER_MAX_RATE_HZ. The times are worked
+//	out in 1/16 timer ticks with integer_sqrt() and rounded as differences,
+//	so no float math is linked in. TCB0 gets the level 1 interrupt so a
+//	long ADC interrupt does not stretch a step.
 //
 // Inputs : none
 //
 // Outputs : none
 //
 //**************************************************************************
-void DRV8825_dir_LOW(void)
-{	
-	PORTC.OUT &= ~PIN5_bm;
+void stepper_init(void)
+{
+	/* Time of step k in 1/16 ticks: 16 * TICKS * sqrt(2k / a) = sqrt(2k * 256 * TICKS^2 / a) */
+	const uint64_t radicand_per_step = 2ULL * 256 * STEPPER_TICKS_PER_S * STEPPER_TICKS_PER_S / STEPPER_ACCEL_HZ_PER_S;
+	uint32_t time_q4 = 0;
+
+	DRV8825_init();
+
+	for (uint16_t k = 0; k < STEPPER_RAMP_LENGTH; k++)
+	{
+		uint32_t next_q4 = integer_sqrt(radicand_per_step * (k + 1));
+		stepper_ramp[k] = (uint16_t)((next_q4 - time_q4 + 8) >> 4);
+		time_q4 = next_q4;
+	}
+
+	stepper_mode = STEPPER_IDLE;
+	stepper_position = 0;
+	stepper_direction = 0;
+	stepper_steps = 0;
+	stepper_homed = 0x00;
+
+	TCB0.CTRLA = 0x00;
+	TCB0.CTRLB = TCB_CNTMODE_INT_gc;	// Periodic interrupt mode
+	TCB0.INTFLAGS = TCB_CAPT_bm;
+	TCB0.INTCTRL = TCB_CAPT_bm;
+	CPUINT.LVL1VEC = TCB0_INT_vect_num;
 }
+//***************************************************************************
+//
+// Function Name : "stepper_next_interval"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Trapezoidal profile, called by the step ISR after every step. The speed
+// moves at most one ramp entry per step: up while it is below the commanded
+// rate, down while it is above it, and down when the remaining distance of
+// a move is no more than the steps needed to stop from the current entry.
+// Stopping and reversing walk down the ramp table whatever the commanded
+// rate, a reversal stops at the first entry and starts over the other way.
+// The current interval always lies between entry k and entry k - 1, so a
+// new command continues from the speed actually turned.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint16_t interval: TCB0 ticks to the next step, 0 to stop
+//
+//**************************************************************************
+static uint16_t stepper_next_interval(void)
+{
+	int8_t wanted = 0;
+	uint16_t to_go = 0;	// Steps left to stop in
+	uint16_t k = stepper_ramp_index;
+	uint16_t interval = stepper_interval;
 
+	if (stepper_mode == STEPPER_RUN)
+	{
+		wanted = stepper_run_direction;
+		to_go = (wanted != 0) ? 0xFFFF : 0;
+	}
+	else if (stepper_mode == STEPPER_MOVE)
+	{
+		int32_t remaining = stepper_target - stepper_position;
+		wanted = (remaining > 0) ? 1 : ((remaining < 0) ? -1 : 0);
+		to_go = (labs(remaining) > 0xFFFF) ? 0xFFFF : (uint16_t)labs(remaining);
+	}
+
+	if (to_go == 0 || wanted != stepper_direction)
+	{
+		if (k == 0)
+		{
+			if (wanted == 0)
+			{
+				stepper_direction = 0;
+				if (stepper_mode == STEPPER_MOVE)
+					stepper_mode = STEPPER_IDLE;
+				return 0;
+			}
+			/* Stopped at the slowest entry, start over the other way */
+			if (wanted > 0)
+				DRV8825_dir_LOW();
+			else
+				DRV8825_dir_HIGH();
+			stepper_direction = wanted;
+		}
+		else
+			k--;
+		interval = stepper_ramp[k];
+	}
+	else if (to_go < k + 1)
+		interval = stepper_ramp[--k];	// Braking distance reached
+	else if (stepper_cruise < interval)
+	{
+		/* Faster: finish the current entry, then one entry per step */
+		if (interval == stepper_ramp[k] && k + 1 < STEPPER_RAMP_LENGTH && to_go >= k + 2)
+			k++;
+		interval = (stepper_ramp[k] > stepper_cruise) ? stepper_ramp[k] : stepper_cruise;
+	}
+	else if (stepper_cruise > interval)
+	{
+		/* Slower: down the ramp until the commanded rate is within one entry */
+		if (k == 0 || stepper_cruise < stepper_ramp[k - 1])
+			interval = stepper_cruise;
+		else
+			interval = stepper_ramp[--k];
+	}
+
+	stepper_ramp_index = k;
+	stepper_interval = interval;
+	return interval;
+}
 //***************************************************************************
 //
-// Function Name : "set_load_current"
+// Function Name : "TCB0_INT_vect"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Step timer compare: one STEP pulse. The profile update between the edges
+//	is the pulse width, well over the 1.9us the DRV8825 needs.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+ISR(TCB0_INT_vect)
+{
+	uint16_t interval;
+
+	TCB0.INTFLAGS = TCB_CAPT_bm;
+	VPORTC_OUT |= PIN4_bm;		// Rising edge on STEP pin
+	stepper_position += stepper_direction;
+	stepper_steps++;
+	interval = stepper_next_interval();
+	VPORTC_OUT &= ~PIN4_bm;		// Falling edge on STEP pin
+
+	if (interval == 0)
+		TCB0.CTRLA = 0x00;
+	else
+		TCB0.CCMP = interval - 1;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_start"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Starts the step timer from rest toward the current command. While the
+// knob turns the ISR follows a new command by itself. Called with
+// interrupts masked.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void stepper_start(void)
+{
+	int8_t wanted;
+
+	if (stepper_direction != 0)
+		return;
+
+	if (stepper_mode == STEPPER_RUN)
+		wanted = stepper_run_direction;
+	else if (stepper_mode == STEPPER_MOVE)
+		wanted = (stepper_target > stepper_position) ? 1 : ((stepper_target < stepper_position) ? -1 : 0);
+	else
+		wanted = 0;
+
+	if (wanted == 0)
+	{
+		if (stepper_mode == STEPPER_MOVE)
+			stepper_mode = STEPPER_IDLE;
+		return;
+	}
+
+	if (wanted > 0)
+		DRV8825_dir_LOW();	// CLOCK-WISE, more current
+	else
+		DRV8825_dir_HIGH();	// COUNTER-CLOCK-WISE, less current
+	stepper_direction = wanted;
+	stepper_ramp_index = 0;
+	stepper_interval = (stepper_ramp[0] > stepper_cruise) ? stepper_ramp[0] : stepper_cruise;
+
+	TCB0.CNT = 0;
+	TCB0.CCMP = stepper_interval - 1;
+	TCB0.INTFLAGS = TCB_CAPT_bm;
+	TCB0.CTRLA = (TCB_CLKSEL_DIV2_gc | TCB_ENABLE_bm);	// CLK_PER/2, Enable
+}
+//***************************************************************************
+//
+// Function Name : "stepper_rate_interval"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Step rate to a TCB0 interval, limited to the rates the timer and the
+// ramp table cover.
+//
+// Inputs :
+//		uint16_t rate_hz: steps per second
+//
+// Outputs :
+//		uint16_t interval: TCB0 ticks per step
+//
+//**************************************************************************
+static uint16_t stepper_rate_interval(uint16_t rate_hz)
+{
+	if (rate_hz < STEPPER_MIN_RATE_HZ)
+		rate_hz = STEPPER_MIN_RATE_HZ;
+	else if (rate_hz > STEPPER_MAX_RATE_HZ)
+		rate_hz = STEPPER_MAX_RATE_HZ;
+	return (uint16_t)(STEPPER_TICKS_PER_S / rate_hz);
+}
+//***************************************************************************
+//
+// Function Name : "stepper_move"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Turns the knob by a number of steps at up to rate_hz, ramping up and
+// down, and returns at once. The distance counts from where the knob is
+// when called, a move given while turning the other way brakes first.
+//
+// Inputs :
+//		int32_t steps: clockwise positive
+//		uint16_t rate_hz: cruise rate, STEPPER_MIN_RATE_HZ ... STEPPER_MAX_RATE_HZ
+//
+// Outputs : none
+//
+//**************************************************************************
+void stepper_move(int32_t steps, uint16_t rate_hz)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	stepper_cruise = stepper_rate_interval(rate_hz);
+	stepper_target = stepper_position + steps;
+	stepper_mode = STEPPER_MOVE;
+	stepper_start();
+	SREG = sreg;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_run"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Turns the knob continuously at a signed rate and returns at once, the
+// ISR ramps to a new rate or through a reversal on its own. Rates under
+// STEPPER_MIN_RATE_HZ stop the knob.
+//
+// Inputs :
+//		int16_t rate_hz: steps per second, clockwise positive
+//
+// Outputs : none
+//
+//**************************************************************************
+void stepper_run(int16_t rate_hz)
+{
+	uint8_t sreg = SREG;
+	uint16_t magnitude = (rate_hz < 0) ? -rate_hz : rate_hz;
+
+	cli();
+	stepper_cruise = stepper_rate_interval(magnitude);
+	if (magnitude < STEPPER_MIN_RATE_HZ)
+		stepper_run_direction = 0;
+	else
+		stepper_run_direction = (rate_hz > 0) ? 1 : -1;
+	stepper_mode = STEPPER_RUN;
+	stepper_start();
+	SREG = sreg;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_stop"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Ramps the knob down to a stop and waits for it.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void stepper_stop(void)
+{
+	stepper_run(0);
+	while (stepper_isBusy());
+	stepper_mode = STEPPER_IDLE;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_isBusy"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Checks if the knob is turning.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t busy: 0x01 while steps are being generated
+//
+//**************************************************************************
+uint8_t stepper_isBusy(void)
+{
+	return (stepper_direction != 0) ? 0x01 : 0x00;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_position_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Knob position, the count is copied with interrupts masked so it is not
+// torn by the step ISR.
+//
+// Inputs : none
+//
+// Outputs :
+//		int32_t position: steps, clockwise positive
+//
+//**************************************************************************
+int32_t stepper_position_read(void)
+{
+	uint8_t sreg = SREG;
+	int32_t position;
+
+	cli();
+	position = stepper_position;
+	SREG = sreg;
+	return position;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_step_count"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Continuously adjusts the stepper motor position until the load current 
-//	drawn from the battery is equal to the programmed value in amps
+// Steps taken in either direction since stepper_init().
+//
+// Inputs : none
+//
+// Outputs :
+//		uint32_t steps: step counter
 //
-// Inputs : float target_current_amps
+//**************************************************************************
+uint32_t stepper_step_count(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t steps;
+
+	cli();
+	steps = stepper_steps;
+	SREG = sreg;
+	return steps;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_home"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Sets the home, called with the knob at rest once open_circuit_load() has
+// turned it past the last current. Knob map positions count from the home.
+//
+// Inputs :
+//		int32_t position: steps the knob is from the home, clockwise positive
 //
 // Outputs : none
 //
 //**************************************************************************
-void set_load_current(float target_current_amps)
+void stepper_home(int32_t position)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	stepper_position = position;
+	stepper_target = position;
+	SREG = sreg;
+	stepper_homed = 0x01;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_home_lost"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Forgets the home after the motor may have lost steps, the next
+// open_circuit_load() searches for open circuit again.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void stepper_home_lost(void)
+{
+	stepper_homed = 0x00;
+}
+//***************************************************************************
+//
+// Function Name : "stepper_isHomed"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Checks if the knob has been homed since power-up.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint8_t homed: 0x01 if the position counts from open circuit
+//
+//**************************************************************************
+uint8_t stepper_isHomed(void)
+{
+	return stepper_homed;
+}
+//***************************************************************************
+//
+// Function Name : "load_control_rate"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// One step of the PI load current controller, see load_control. The
+//	output is a signed step rate, positive turns the knob clockwise for
+//	more current. It is limited to max_rate_hz, and the integral only
+//	moves while the output is not pinned at the limit in the direction
+//	of the error, so it does not wind up during a long approach.
+//
+// Inputs :
+//		int32_t *integral_q16: integral term in Hz, 16 fraction bits, 0 to start
+//		int32_t error_ma: target minus filtered current
+//		uint16_t period_us: time since the last step, a multiple of 100us
+//
+// Outputs :
+//		int16_t rate_hz: step rate for stepper_run()
+//
+//**************************************************************************
+static int16_t load_control_rate(int32_t *integral_q16, int32_t error_ma, uint16_t period_us)
+{
+	int32_t rate_limit_q8 = (int32_t)load_control.max_rate_hz << 8;
+	/* Integral gain per tick with 24 fraction bits, ki_q8 * period * 2^16 / 10^6 rounded: a tick of
+	   1ms is 6.55 at the default gain, truncating it to 16 fraction bits lost 8% of it and small
+	   gains entirely. Fits in 32 bits up to 3.2ms per tick at any ki_q8 */
+	int32_t ki_period_q24 = (int32_t)(((uint32_t)load_control.ki_q8 * (period_us / 100) * 2048 + 1562) / 3125);
+	int32_t error_da = error_ma / 100;	// 0.1A units keep the gain products in 32 bits
+	int32_t command_q8 = (int32_t)load_control.kp_q8 * error_da / 10 + (*integral_q16 >> 8);
+
+	if ((command_q8 < rate_limit_q8 || error_da < 0) && (command_q8 > -rate_limit_q8 || error_da > 0))
+	{
+		*integral_q16 += (error_da * ki_period_q24 + 128) >> 8;
+		if (*integral_q16 > (rate_limit_q8 << 8))
+			*integral_q16 = rate_limit_q8 << 8;
+		else if (*integral_q16 < -(rate_limit_q8 << 8))
+			*integral_q16 = -(rate_limit_q8 << 8);
+		command_q8 = (int32_t)load_control.kp_q8 * error_da / 10 + (*integral_q16 >> 8);
+	}
+	if (command_q8 > rate_limit_q8)
+		command_q8 = rate_limit_q8;
+	else if (command_q8 < -rate_limit_q8)
+		command_q8 = -rate_limit_q8;
+	return (int16_t)(command_q8 >> 8);
+}
+//***************************************************************************
+//
+// Function Name : "set_load_current"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Moves the knob until the load current drawn from the battery is at the
+//	programmed value in milliamps. load_control_rate() runs every
+//	LOAD_CONTROL_PERIOD_US on the filtered current (see LOAD_CONTROL_FILTER)
+//	and its step rate goes to stepper_run(), which ramps the knob to it.
+//	The knob to current ratio only scales the loop gain, the defaults stay
+//	stable from 0.1A to 1A per step.
+//	With a knob map and a homed knob the knob first moves straight to
+//	where the map expects KNOB_MAP_APPROACH_PCT of the target at
+//	pack_voltage_mv, so the controller only trims. Once settled the knob
+//	is braked and the current is read afresh where it came to rest, that
+//	position and current are fed back into the map.
+//	Done when the error stays within tolerance_ma for settle_ms, see
+//	load_control, or after timeout_ms. last_load_control reports the time
+//	to target and the overshoot.
+//
+// Inputs : int32_t target_current_ma
+//
+// Outputs :
+//		uint8_t settled: 0x01 if the current settled at the target, 0x00 on timeout
+//
+//**************************************************************************
+uint8_t set_load_current(int32_t target_current_ma)
 {	
-	load_current_amps = load_current_Read();
-	float error = load_current_amps - target_current_amps;	// error between measured current and target current
+	sample_filter filter;
+	load_control_report *report = &last_load_control;
+	const uint32_t ticks_per_ms = 1000UL * TIMESTAMP_TICKS_PER_US;
+	int32_t integral_q16 = 0;
+	uint32_t elapsed_ticks = 0, inside_ticks = 0;
+	uint32_t first_step = stepper_step_count();
+	int32_t feedforward;
+	int8_t approach;
+	uint16_t period_start, now;
+
+	sample_filter_init(&filter, LOAD_CONTROL_FILTER, LOAD_CONTROL_WINDOW);
+	load_current_ma = sample_filter_apply(&filter, load_current_Read());
+	approach = (target_current_ma >= load_current_ma) ? 1 : -1;
+
+	report->target_ma = target_current_ma;
+	report->overshoot_ma = 0;
+	report->time_to_target_ms = 0xFFFF;
+	report->settled = 0x00;
+
+	period_start = timestamp_now();
 
-	/* Remain in while loop until load current = target current +/- 10 amps */
-	while(fabs(error) > 10)
+	/* Feedforward to just short of the target, counted in the time to target */
+	feedforward = knob_map_position(target_current_ma / 100 * KNOB_MAP_APPROACH_PCT, pack_voltage_mv);
+	if (feedforward >= 0)
 	{
-		/* Poll the load current reading from the shunt */
-		load_current_amps = load_current_Read();
-		error = load_current_amps - target_current_amps;
-		
-		/* Turn knob CLOCK-WISE if load current is LESS than target value*/
-		if (error <= 0) { DRV8825_dir_LOW(); }
-		/* Turn knob COUNTER-CLOCK-WISE if load current is MORE than target value*/
-		else if (error >= 0) { DRV8825_dir_HIGH(); }
-		
-		/* Rotate the knob by one step of the NEMA-17 on each iteration */
-		DRV8825_step();
+		stepper_move(feedforward - stepper_position_read(), load_control.max_rate_hz);
+		while (stepper_isBusy())
+		{
+			now = timestamp_now();
+			elapsed_ticks += (uint16_t)(now - period_start);
+			period_start = now;
+		}
+		load_current_ma = sample_filter_apply(&filter, load_current_Read());
 	}
+
+	for (;;)
+	{
+		int32_t error_ma = target_current_ma - load_current_ma;	// positive -> more current needed
+		int32_t past_ma = (load_current_ma - target_current_ma) * approach;
+
+		if (past_ma > report->overshoot_ma)
+			report->overshoot_ma = past_ma;
+
+		/* Settle criterion */
+		if (labs(error_ma) <= load_control.tolerance_ma)
+		{
+			if (report->time_to_target_ms == 0xFFFF)
+				report->time_to_target_ms = (uint16_t)(elapsed_ticks / ticks_per_ms);
+			if (inside_ticks >= (uint32_t)load_control.settle_ms * ticks_per_ms)
+			{
+				report->settled = 0x01;
+				break;
+			}
+		}
+		else
+			inside_ticks = 0;
+		if (elapsed_ticks >= (uint32_t)load_control.timeout_ms * ticks_per_ms)
+			break;
+
+		stepper_run(load_control_rate(&integral_q16, error_ma, LOAD_CONTROL_PERIOD_US));
+
+		/* Readings are paced to the control period, the knob keeps turning meanwhile */
+		do
+			now = timestamp_now();
+		while ((uint16_t)(now - period_start) < LOAD_CONTROL_PERIOD_US * TIMESTAMP_TICKS_PER_US);
+
+		elapsed_ticks += (uint16_t)(now - period_start);
+		if (labs(error_ma) <= load_control.tolerance_ma)
+			inside_ticks += (uint16_t)(now - period_start);
+		period_start = now;
+
+		/* Poll the filtered load current reading from the shunt */
+		load_current_ma = sample_filter_apply(&filter, load_current_Read());
+	}
+
+	/* Brake, then refill the filter window with readings at the knob position it stopped at */
+	stepper_stop();
+	for (uint8_t i = 0; i < LOAD_CONTROL_WINDOW; i++)
+		load_current_ma = sample_filter_apply(&filter, load_current_Read());
+	report->final_ma = load_current_ma;
+	report->steps = stepper_step_count() - first_step;
+	report->settle_time_ms = (uint16_t)(elapsed_ticks / ticks_per_ms);
+	if (report->settled)
+		knob_map_learn(stepper_position_read(), load_current_ma, pack_voltage_mv);
+	return report->settled;
 }
 
+//***************************************************************************
+//
+// Function Name : "load_hold"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Constant-current hold. The multi-rate scheduler samples current, cells
+//	and temperature on the hardware sample clock, and the controller runs
+//	once per scheduled current sample, so its tick is fixed by the sample
+//	clock and not by how long the loop takes. load_control_rate() keeps
+//	the current at the target the whole time: the pile heats and the pack
+//	sags at a roughly steady rate, and the integral of a PI driving an
+//	integrating knob follows a steady drift with no lasting error. Every
+//	regulation error goes into last_load_hold, with an evenly decimated
+//	log. Over the last LOAD_HOLD_MEASURE_PCT of the hold every new cell and
+//	current sample is added to loaded_cell_stats and loaded_current_stats,
+//	a loaded measurement at a current that did not move. The knob stops at
+//	the end, the load stays applied.
+//
+// Inputs :
+//		int32_t target_current_ma: current to hold
+//		uint16_t duration_ms: length of the hold
+//
+// Outputs :
+//		uint8_t steady: 0x01 if the error stayed within tolerance_ma while measuring
+//
+//**************************************************************************
+uint8_t load_hold(int32_t target_current_ma, uint16_t duration_ms)
+{
+	load_hold_report *report = &last_load_hold;
+	uint16_t rate_hz = adc_schedule_table[SCHEDULE_CURRENT].rate_hz;
+	uint16_t period_us = (uint16_t)((1000000UL / rate_hz) / 100 * 100);
+	uint32_t ticks = (uint32_t)duration_ms * rate_hz / 1000;
+	uint32_t measure_from = ticks - ticks * LOAD_HOLD_MEASURE_PCT / 100;
+	uint32_t log_every = ticks / LOAD_HOLD_LOG_POINTS + 1;
+	uint32_t log_countdown = 0;
+	uint32_t current_seen, seen;
+	uint32_t cell_seen[PACK_CELL_COUNT];
+	int32_t integral_q16 = 0;
+	sample_filter filter;
+
+	measurement_stats_init(&report->error_stats);
+	report->worst_error_ma = 0;
+	report->log_count = 0;
+	report->missed_ticks = 0;
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		measurement_stats_init(&loaded_cell_stats[i]);
+	measurement_stats_init(&loaded_current_stats);
+	sample_filter_init(&filter, LOAD_CONTROL_FILTER, LOAD_CONTROL_WINDOW);
+
+	scheduler_start();
+	current_seen = scheduler_sample_count(ADC_CH_LOAD_CURRENT);
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		cell_seen[i] = scheduler_sample_count(adc_scan_cells[i]);
+
+	for (uint32_t tick = 0; tick < ticks; tick++)
+	{
+		int32_t error_ma;
+
+		/* Control tick: the next scheduled current sample */
+		while ((seen = scheduler_sample_count(ADC_CH_LOAD_CURRENT)) == current_seen);
+		report->missed_ticks += (uint16_t)(seen - current_seen - 1);
+		current_seen = seen;
+
+		load_current_ma = sample_filter_apply(&filter, load_current_from_code(scheduler_read(ADC_CH_LOAD_CURRENT)));
+		error_ma = target_current_ma - load_current_ma;
+		stepper_run(load_control_rate(&integral_q16, error_ma, period_us));
+
+		measurement_stats_add(&report->error_stats, error_ma);
+		if (log_countdown == 0)
+		{
+			if (report->log_count < LOAD_HOLD_LOG_POINTS)
+				report->error_log_da[report->log_count++] = (int16_t)(error_ma / 100);
+			log_countdown = log_every;
+		}
+		log_countdown--;
+
+		if (tick < measure_from)
+			continue;
+		if (labs(error_ma) > report->worst_error_ma)
+			report->worst_error_ma = labs(error_ma);
+		measurement_stats_add(&loaded_current_stats, load_current_ma);
+		for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+		{
+			seen = scheduler_sample_count(adc_scan_cells[i]);
+			if (seen != cell_seen[i])
+			{
+				cell_seen[i] = seen;
+				measurement_stats_add(&loaded_cell_stats[i], fixed_point_apply(&cell_scale_mv, scheduler_read(adc_scan_cells[i])));
+			}
+		}
+	}
+
+	stepper_stop();
+	report->temperature_c = temperature_from_code(scheduler_read(ADC_CH_TEMPERATURE));
+	adc_utilization_permille = scheduler_utilization();
+	scheduler_stop();
+	return (report->worst_error_ma <= load_control.tolerance_ma) ? 0x01 : 0x00;
+}
 //***************************************************************************
 //
 // Function Name : "open_circuit_load"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Sets the load to an open circuit so zero amps are drawn from the battery
+// Sets the load to an open circuit so zero amps are drawn from the battery,
+//	as fast as the knob can turn. A homed knob makes one ramped move back
+//	to the open position, otherwise the knob runs counter-clockwise at
+//	STEPPER_MAX_RATE_HZ. Either way it brakes as soon as LOAD_OPEN_ZERO_READINGS
+//	filtered readings in a row are inside the current deadband, a homed
+//	knob keeps counting from its home. An unhomed one is homed
+//	STEPPER_RAMP_LENGTH steps, the full speed braking distance, below the
+//	position of the first of those readings, so the home does not move
+//	with the rate the retract braked from. While current flows it has to fall by LOAD_OPEN_STALL_DROP_MA
+//	every LOAD_OPEN_STALL_STEPS steps. If it does not, the motor has
+//	stalled or the pile is at its end stop: the home is dropped and the
+//	retract goes on at half the rate, and at STEPPER_MIN_RATE_HZ it gives
+//	up with the load still closed. last_load_open reports the retract.
+//	The amplifier is auto-zeroed once the load is open.
 //
 // Inputs : none
 //
-// Outputs : none
+// Outputs :
+//		uint8_t opened: 0x01 if the current is confirmed zero, 0x00 if the knob could not open the load
 //
 //**************************************************************************
-void open_circuit_load(void)
+uint8_t open_circuit_load(void)
 {	
-	DRV8825_dir_HIGH();	// rotate knob COUNTER-CLOCK-WISE
-	load_current_amps = load_current_Read();
-	
-	/* Rotate knob until current is at minimum measurable value */
-	while(load_current_amps > 10)
+	sample_filter filter;
+	load_open_report *report = &last_load_open;
+	uint16_t rate_hz = STEPPER_MAX_RATE_HZ;
+	uint32_t first_step = stepper_step_count();
+	uint32_t elapsed_ticks = 0;
+	uint32_t reference_step = first_step;
+	int32_t reference_ma;
+	uint8_t zero_readings = 0;
+	uint16_t last = timestamp_now(), now;
+	int32_t position = stepper_position_read();
+	int32_t open_position = position;	// Knob position where the current went to zero
+
+	report->stalls = 0;
+	report->opened = 0x00;
+
+	sample_filter_init(&filter, LOAD_CONTROL_FILTER, LOAD_CONTROL_WINDOW);
+	load_current_ma = sample_filter_apply(&filter, load_current_Read());
+	reference_ma = load_current_ma;
+
+	/* Rotate knob COUNTER-CLOCK-WISE, straight home if the knob knows where that is */
+	if (stepper_isHomed() && position > 0)
+		stepper_move(-position, rate_hz);
+	else
+		stepper_run(-(int16_t)rate_hz);
+
+	while (zero_readings < LOAD_OPEN_ZERO_READINGS)
 	{
-		/* Poll the load current reading from the shunt */
-		load_current_amps = load_current_Read();
-		/* Rotate the knob by one step of the NEMA-17 on each iteration */
-		DRV8825_step();
+		/* Poll the filtered load current reading from the shunt */
+		load_current_ma = sample_filter_apply(&filter, load_current_Read());
+		now = timestamp_now();
+		elapsed_ticks += (uint16_t)(now - last);
+		last = now;
+
+		if (load_current_ma <= 0)
+		{
+			if (zero_readings == 0)
+				open_position = stepper_position_read();
+			zero_readings++;
+			continue;
+		}
+		zero_readings = 0;
+
+		/* The current has to keep falling while the knob turns */
+		if (load_current_ma <= reference_ma - LOAD_OPEN_STALL_DROP_MA)
+		{
+			reference_ma = load_current_ma;
+			reference_step = stepper_step_count();
+		}
+		else if (stepper_step_count() - reference_step >= LOAD_OPEN_STALL_STEPS || !stepper_isBusy())
+		{
+			/* Stalled, at the end stop, or home was not open: steps were lost, search at a lower rate */
+			report->stalls++;
+			stepper_stop();
+			stepper_home_lost();
+			if (rate_hz == STEPPER_MIN_RATE_HZ)
+				break;
+			rate_hz = (rate_hz / 2 > STEPPER_MIN_RATE_HZ) ? rate_hz / 2 : STEPPER_MIN_RATE_HZ;
+			stepper_run(-(int16_t)rate_hz);
+			reference_ma = load_current_ma;
+			reference_step = stepper_step_count();
+		}
 	}
+
+	/* Brake, the ramp down is the margin past the last current */
+	stepper_stop();
+	report->steps = stepper_step_count() - first_step;
+	report->retract_ms = (uint16_t)((elapsed_ticks + (uint16_t)(timestamp_now() - last)) / (1000UL * TIMESTAMP_TICKS_PER_US));
+	if (zero_readings < LOAD_OPEN_ZERO_READINGS)
+		return 0x00;
+
+	report->opened = 0x01;
+	if (!stepper_isHomed())
+		stepper_home(stepper_position_read() - open_position + STEPPER_RAMP_LENGTH);
 	
-	/* Complete one more rotation to ensure carbon pile is completely OFF */
-	for(uint8_t i = 0; i < 200; i++) { DRV8825_step();	}
-}
\ No newline at end of file
+	/* The load is open now, refresh the amplifier offsets */
+	opamp_auto_zero();
+	return 0x01;
+}
@@ -0,0 +1,144 @@
+#include "main.h"
+
+/* Diagnostic scan: every tap single-ended, every cell across its taps, then the whole pack */
+static const uint8_t tap_diagnostic_scan[TAP_DIAGNOSTIC_LENGTH] = {
+	PACK_CELLS(PACK_TAP_CHANNEL_ID)
+	PACK_CELLS(PACK_CELL_CHANNEL_ID)
+	ADC_CH_PACK
+};
+
+/* Error screen text of every fault, indexed by TAP_FAULT */
+static const char *const tap_fault_text[TAP_FAULT_COUNT] = {
+	"Connection OK       ",
+	"No pack voltage     ",
+	"Tap open or loose   ",
+	"Cell reversed       ",
+	"Taps out of order   ",
+	"Cell out of range   ",
+	"Readings disagree   ",
+	"Cells != pack       "
+};
+
+//***************************************************************************
+//
+// Function Name : "tap_diagnostics_fail"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Records the first fault found by the diagnostic pass.
+//
+// Inputs :
+//		tap_diagnosis *diagnosis: result of the pass
+//		TAP_FAULT fault: what is wrong
+//		uint8_t tap: index of the tap to check, 0 for B1+
+//		int32_t measured_mv: the reading that failed
+//
+// Outputs :
+//		TAP_FAULT fault: the fault, for chaining
+//
+//**************************************************************************
+static TAP_FAULT tap_diagnostics_fail(tap_diagnosis *diagnosis, TAP_FAULT fault, uint8_t tap, int32_t measured_mv)
+{
+	diagnosis->fault = fault;
+	diagnosis->tap = tap;
+	diagnosis->measured_mv = measured_mv;
+	return fault;
+}
+//***************************************************************************
+//
+// Function Name : "tap_diagnostics_run"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Pre-test check of the balance lead, one scan of a few milliseconds
+// with no load applied. Walking up from B1+, every tap must read above
+// CELL_MIN_MV (an open tap is pulled to ground by its divider) and above
+// the tap below it, every cell read across its taps must be positive and
+// within CELL_MIN_MV ... CELL_MAX_MV, and must agree with the difference
+// of the single-ended taps within TAP_DIAGNOSTIC_TOLERANCE_MV. Finally
+// the cells must add up to the pack voltage. The first failure is kept
+// with the tap the operator has to fix.
+//
+// Inputs :
+//		tap_diagnosis *diagnosis: receives the result
+//
+// Outputs :
+//		TAP_FAULT fault: TAP_FAULT_NONE if the pack can be loaded
+//
+//**************************************************************************
+TAP_FAULT tap_diagnostics_run(tap_diagnosis *diagnosis)
+{
+	int32_t codes[TAP_DIAGNOSTIC_LENGTH];
+	int32_t tap_mv[PACK_CELL_COUNT];
+	int32_t cell_mv[PACK_CELL_COUNT];
+	int32_t pack_mv, sum_mv = 0;
+	uint16_t start = timestamp_now();
+	uint8_t complete;
+
+	complete = ADC_scan_read(tap_diagnostic_scan, TAP_DIAGNOSTIC_LENGTH, codes);
+	diagnosis->duration_us = (uint16_t)(timestamp_now() - start) / TIMESTAMP_TICKS_PER_US;
+
+	/* Without every reading nothing can be said about the lead, the pack is not loaded */
+	if (!complete)
+		return tap_diagnostics_fail(diagnosis, TAP_FAULT_NO_PACK, PACK_CELL_COUNT - 1, 0);
+
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		tap_mv[k] = fixed_point_apply(&cell_scale_mv, codes[k]);
+		cell_mv[k] = fixed_point_apply(&cell_scale_mv, codes[PACK_CELL_COUNT + k]);
+	}
+	pack_mv = fixed_point_apply(&cell_scale_mv, codes[2 * PACK_CELL_COUNT]);
+
+	if (pack_mv < 100)
+		return tap_diagnostics_fail(diagnosis, TAP_FAULT_NO_PACK, PACK_CELL_COUNT - 1, pack_mv);
+
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		int32_t below_mv = (k == 0) ? 0 : tap_mv[k - 1];
+
+		if (tap_mv[k] < CELL_MIN_MV)
+			return tap_diagnostics_fail(diagnosis, TAP_FAULT_OPEN, k, tap_mv[k]);
+		if (cell_mv[k] < -CELL_MIN_MV)
+			return tap_diagnostics_fail(diagnosis, TAP_FAULT_REVERSED, k, cell_mv[k]);
+		if (tap_mv[k] <= below_mv)
+			return tap_diagnostics_fail(diagnosis, TAP_FAULT_ORDER, k, tap_mv[k]);
+		if (cell_mv[k] < CELL_MIN_MV || cell_mv[k] > CELL_MAX_MV)
+			return tap_diagnostics_fail(diagnosis, TAP_FAULT_RANGE, k, cell_mv[k]);
+		if (labs(cell_mv[k] - (tap_mv[k] - below_mv)) > TAP_DIAGNOSTIC_TOLERANCE_MV)
+			return tap_diagnostics_fail(diagnosis, TAP_FAULT_MISMATCH, k, cell_mv[k]);
+		sum_mv += cell_mv[k];
+	}
+
+	/* Every cell adds its own divider error, the tolerance grows with the cell count */
+	if (labs(sum_mv - pack_mv) > (int32_t)TAP_DIAGNOSTIC_TOLERANCE_MV * PACK_CELL_COUNT)
+		return tap_diagnostics_fail(diagnosis, TAP_FAULT_SUM, PACK_CELL_COUNT - 1, sum_mv);
+
+	return tap_diagnostics_fail(diagnosis, TAP_FAULT_NONE, 0, pack_mv);
+}
+//***************************************************************************
+//
+// Function Name : "tap_diagnostics_display"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Shows a failed diagnostic pass on the error screen: which clip to check,
+// what is wrong with it and the reading that failed.
+//
+// Inputs :
+//		const tap_diagnosis *diagnosis: result of tap_diagnostics_run()
+//
+// Outputs : none
+//
+//**************************************************************************
+void tap_diagnostics_display(const tap_diagnosis *diagnosis)
+{
+	int32_t mv = diagnosis->measured_mv;
+	char sign = (mv < 0) ? '-' : ' ';
+
+	if (mv < 0)
+		mv = -mv;
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Failed! Check B%u+   ", diagnosis->tap + 1);
+	sprintf(dsp_buff[1], "%s", tap_fault_text[diagnosis->fault]);
+	sprintf(dsp_buff[2], "Reads %c%2ld.%03ldV      ", sign, (long)(mv / 1000), (long)(mv % 1000));
+	sprintf(dsp_buff[3], "Press OK or BACK    ");
+	update_lcd();
+}
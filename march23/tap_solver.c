@@ -0,0 +1,348 @@
+#include "main.h"
+
+/* Scan order of every cell strategy, indexed by CELL_STRATEGY */
+static const uint8_t *const cell_strategy_sequence[CELL_STRATEGY_COUNT] = {adc_scan_cells, adc_scan_taps};
+static const char *const cell_strategy_name[CELL_STRATEGY_COUNT] = {"Diff", "Taps"};
+
+//***************************************************************************
+//
+// Function Name : "tap_solver_evaluate"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Noise and time of one scan of a strategy at one accumulation setting.
+// Every channel loses the accumulation steps its reference saves (see
+// ADC_scan_load), the variance of a conversion drops by 2 per doubling of
+// the samples. A tap-strategy cell is the difference of two independent
+// taps, so its variance is the sum of theirs. The time counts the
+// settling conversions and the accumulated conversion of every channel.
+//
+// Inputs :
+//		CELL_STRATEGY strategy: strategy being planned
+//		const uint8_t *ref: reference table index of every channel
+//		const uint32_t *conversion_var: variance of one conversion of every channel in uV^2
+//		const uint8_t *settle: settling conversions of every channel
+//		uint8_t sampnum: accumulation to evaluate, ADC_SAMPNUM_xxx_gc
+//		cell_strategy_plan *plan: receives sampnum, sigma_uv, worst_sigma_uv and scan_us
+//
+// Outputs : none
+//
+//**************************************************************************
+static void tap_solver_evaluate(CELL_STRATEGY strategy, const uint8_t *ref, const uint32_t *conversion_var,
+								const uint8_t *settle, uint8_t sampnum, cell_strategy_plan *plan)
+{
+	uint32_t channel_var[PACK_CELL_COUNT];
+	uint32_t clocks = 0;
+
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		uint8_t reduction = adc_reference_table[ref[k]].sampnum_reduction;
+		uint8_t effective = (sampnum > reduction) ? sampnum - reduction : ADC_SAMPNUM_NONE_gc;
+		uint16_t conversion_clocks = ADC_CONVERSION_CLOCKS + adc_channel_table[cell_strategy_sequence[strategy][k]].samplen;
+
+		channel_var[k] = conversion_var[k] >> effective;
+		clocks += (uint32_t)conversion_clocks * (settle[k] + (1U << effective));
+	}
+
+	plan->sampnum = sampnum;
+	plan->worst_sigma_uv = 0;
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		uint32_t var = channel_var[k];
+		uint32_t sigma;
+
+		if (strategy == CELL_STRATEGY_TAPS && k > 0)
+			var += channel_var[k - 1];
+		sigma = integer_sqrt(var);
+		plan->sigma_uv[k] = (sigma > 0xFFFF) ? 0xFFFF : (uint16_t)sigma;
+		if (plan->sigma_uv[k] > plan->worst_sigma_uv)
+			plan->worst_sigma_uv = plan->sigma_uv[k];
+	}
+	plan->scan_us = clocks * ADC_PRESCALER / (F_CPU / 1000000UL);
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_plan"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Predicts how precise and how fast a strategy measures the cells of a
+// pack, assuming equal cells. Each channel is put on the reference
+// auto-ranging settles on for its pin voltage: cells sit at 1/N of the
+// pack, tap k at k/N of it. One conversion has TAP_SOLVER_NOISE_LSB_Q4
+// of noise, an LSB is VREF/4096 single-ended and twice that differential,
+// times the divider at the cell. A reference change between neighbours
+// in the scan costs ADC_REF_SETTLE_CONVERSIONS. The smallest accumulation
+// that brings every cell to CELL_TARGET_SIGMA_UV is chosen, the largest
+// one if none does. A tap above the widest reference makes the strategy
+// infeasible.
+//
+// Inputs :
+//		CELL_STRATEGY strategy: strategy to plan
+//		int32_t pack_mv: voltage of the whole pack
+//		cell_strategy_plan *plan: receives the prediction
+//
+// Outputs : none
+//
+//**************************************************************************
+void tap_solver_plan(CELL_STRATEGY strategy, int32_t pack_mv, cell_strategy_plan *plan)
+{
+	uint8_t ref[PACK_CELL_COUNT];
+	uint32_t conversion_var[PACK_CELL_COUNT];
+	uint8_t settle[PACK_CELL_COUNT];
+	uint32_t cell_mv = (pack_mv > 0) ? (uint32_t)pack_mv / PACK_CELL_COUNT : 0;
+	uint8_t sampnum;
+
+	plan->feasible = 0x01;
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		uint32_t level_mv = ((strategy == CELL_STRATEGY_TAPS) ? cell_mv * (k + 1) : cell_mv) / battery_voltage_divider_ratios;
+		uint32_t sigma_uv;
+		uint8_t r = 0;
+
+		/* Auto-ranging moves down while the reading stays under ADC_RANGE_DOWN_Q8 of the smaller reference */
+		while (r + 1 < adc_reference_count && level_mv * 256 > (uint32_t)ADC_RANGE_DOWN_Q8 * adc_reference_table[r].mv)
+			r++;
+		if (level_mv * 256 >= (uint32_t)ADC_RANGE_UP_Q8 * adc_reference_table[r].mv)
+			plan->feasible = 0x00;
+		ref[k] = r;
+
+		sigma_uv = (uint32_t)adc_reference_table[r].mv * 1000 * battery_voltage_divider_ratios * TAP_SOLVER_NOISE_LSB_Q4 / (4096UL * 16);
+		if (adc_channel_table[cell_strategy_sequence[strategy][k]].mode == 0x01)
+			sigma_uv *= 2;
+		conversion_var[k] = sigma_uv * sigma_uv;
+	}
+
+	/* The scan repeats, the first channel follows the last one */
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+		settle[k] = (ref[k] != ref[(k == 0) ? PACK_CELL_COUNT - 1 : k - 1]) ? ADC_REF_SETTLE_CONVERSIONS : TAP_SOLVER_SETTLE_CONVERSIONS;
+
+	for (sampnum = ADC_SAMPNUM_NONE_gc; sampnum < ADC_SAMPNUM_ACC128_gc; sampnum++)
+	{
+		tap_solver_evaluate(strategy, ref, conversion_var, settle, sampnum, plan);
+		if (plan->worst_sigma_uv <= CELL_TARGET_SIGMA_UV)
+			return;
+	}
+	tap_solver_evaluate(strategy, ref, conversion_var, settle, ADC_SAMPNUM_ACC128_gc, plan);
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_apply"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Makes a strategy the one tap_solver_read() uses and gives its channels
+// the planned accumulation.
+//
+// Inputs :
+//		CELL_STRATEGY strategy: planned strategy
+//
+// Outputs : none
+//
+//**************************************************************************
+static void tap_solver_apply(CELL_STRATEGY strategy)
+{
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+		ADC_set_oversampling(cell_strategy_sequence[strategy][k], cell_strategy_plans[strategy].sampnum);
+	cell_strategy = strategy;
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_select"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Plans both strategies for the pack voltage and sets up the faster one
+// of those that reach CELL_TARGET_SIGMA_UV. If neither does, the less
+// noisy one is taken. The differential path wins ties and stays in use
+// whenever the taps do not fit the references. The accumulation stays
+// changed until tap_solver_release().
+//
+// Inputs :
+//		int32_t pack_mv: voltage of the whole pack
+//
+// Outputs :
+//		CELL_STRATEGY strategy: the strategy selected
+//
+//**************************************************************************
+CELL_STRATEGY tap_solver_select(int32_t pack_mv)
+{
+	const cell_strategy_plan *diff = &cell_strategy_plans[CELL_STRATEGY_DIFFERENTIAL];
+	const cell_strategy_plan *taps = &cell_strategy_plans[CELL_STRATEGY_TAPS];
+	CELL_STRATEGY selected = CELL_STRATEGY_DIFFERENTIAL;
+
+	for (uint8_t i = 0; i < CELL_STRATEGY_COUNT; i++)
+		tap_solver_plan((CELL_STRATEGY)i, pack_mv, &cell_strategy_plans[i]);
+
+	if (taps->feasible)
+	{
+		uint8_t diff_meets = diff->feasible && diff->worst_sigma_uv <= CELL_TARGET_SIGMA_UV;
+		uint8_t taps_meets = taps->worst_sigma_uv <= CELL_TARGET_SIGMA_UV;
+
+		if (!diff->feasible)
+			selected = CELL_STRATEGY_TAPS;
+		else if (taps_meets && (!diff_meets || taps->scan_us < diff->scan_us))
+			selected = CELL_STRATEGY_TAPS;
+		else if (!taps_meets && !diff_meets && taps->worst_sigma_uv < diff->worst_sigma_uv)
+			selected = CELL_STRATEGY_TAPS;
+	}
+
+	tap_solver_apply(selected);
+	return selected;
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_release"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Puts the cell and tap channels back to CELL_SAMPNUM, the loaded
+// snapshot and the capture keep their usual conversion time.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void tap_solver_release(void)
+{
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+	{
+		ADC_set_oversampling(adc_scan_cells[k], CELL_SAMPNUM);
+		ADC_set_oversampling(adc_scan_taps[k], CELL_SAMPNUM);
+	}
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_read"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// One scan of every cell with the selected strategy. The tap strategy
+// converts B1_POS ... top tap against ground in a single pass and the
+// cells are the differences of neighbouring taps.
+//
+// Inputs :
+//		int32_t *cell_uv: destination, the voltage across every cell in uV
+//
+// Outputs :
+//		uint8_t complete: 0x01 if the scan returned every cell
+//
+//**************************************************************************
+uint8_t tap_solver_read(int32_t *cell_uv)
+{
+	int32_t codes[PACK_CELL_COUNT];
+	uint8_t complete = ADC_scan_read(cell_strategy_sequence[cell_strategy], PACK_CELL_COUNT, codes);
+
+	/* Scale factor times the divider ratio undoes the attenuation */
+	for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+		cell_uv[k] = fixed_point_apply(&adc_scale_uv, codes[k]) * battery_voltage_divider_ratios;
+
+	if (cell_strategy == CELL_STRATEGY_TAPS)
+		for (uint8_t k = PACK_CELL_COUNT - 1; k > 0; k--)
+			cell_uv[k] -= cell_uv[k - 1];
+	return complete;
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_benchmark"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Runs both feasible strategies with their planned accumulation against
+// the connected pack: TAP_SOLVER_BENCH_SCANS timed scans each, after a
+// scan per reference to let auto-ranging settle. The mean scan time and
+// the largest standard deviation of a cell go to cell_strategy_benchmarks,
+// to be compared with the predictions in cell_strategy_plans. The strategy
+// tap_solver_select() picks is left selected with the default accumulation.
+//
+// Inputs :
+//		int32_t pack_mv: voltage of the whole pack
+//
+// Outputs : none
+//
+//**************************************************************************
+void tap_solver_benchmark(int32_t pack_mv)
+{
+	measurement_stats stats[PACK_CELL_COUNT];
+	int32_t cell_uv[PACK_CELL_COUNT];
+	CELL_STRATEGY selected = tap_solver_select(pack_mv);
+
+	for (uint8_t i = 0; i < CELL_STRATEGY_COUNT; i++)
+	{
+		cell_strategy_benchmark *bench = &cell_strategy_benchmarks[i];
+		uint32_t ticks = 0;
+
+		bench->scan_us = 0;
+		bench->worst_sigma_uv = 0;
+		if (!cell_strategy_plans[i].feasible)
+			continue;
+
+		tap_solver_apply((CELL_STRATEGY)i);
+		for (uint8_t n = 0; n < adc_reference_count; n++)
+			tap_solver_read(cell_uv);
+
+		for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+			measurement_stats_init(&stats[k]);
+		for (uint8_t n = 0; n < TAP_SOLVER_BENCH_SCANS; n++)
+		{
+			uint16_t start = timestamp_now();
+			tap_solver_read(cell_uv);
+			ticks += (uint16_t)(timestamp_now() - start);
+			for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+				measurement_stats_add(&stats[k], cell_uv[k]);
+		}
+
+		bench->scan_us = ticks / (TAP_SOLVER_BENCH_SCANS * TIMESTAMP_TICKS_PER_US);
+		for (uint8_t k = 0; k < PACK_CELL_COUNT; k++)
+		{
+			uint32_t sigma = integer_sqrt(measurement_stats_variance(&stats[k]));
+			if (sigma > 0xFFFF)
+				sigma = 0xFFFF;
+			if (sigma > bench->worst_sigma_uv)
+				bench->worst_sigma_uv = (uint16_t)sigma;
+		}
+	}
+
+	tap_solver_release();
+	cell_strategy = selected;
+}
+//***************************************************************************
+//
+// Function Name : "tap_solver_view"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Entered by holding DOWN at power-up. Benchmarks both strategies on the
+// connected pack and shows the measured scan time and worst cell noise
+// of each and the strategy tests will use, until OK is pressed. Runs
+// before interrupts are enabled, so the buttons are polled and their
+// flags cleared on the way out.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void tap_solver_view(void)
+{
+	int32_t code;
+
+	ADC_scan_read(adc_scan_pack, 1, &code);
+	pack_voltage_mv = fixed_point_apply(&cell_scale_mv, code);
+	tap_solver_benchmark(pack_voltage_mv);
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Pack %2ld.%02ldV use %s", (long)(pack_voltage_mv / 1000), (long)((pack_voltage_mv % 1000) / 10),
+			cell_strategy_name[cell_strategy]);
+	for (uint8_t i = 0; i < CELL_STRATEGY_COUNT; i++)
+	{
+		const cell_strategy_benchmark *bench = &cell_strategy_benchmarks[i];
+
+		if (bench->scan_us == 0)
+			sprintf(dsp_buff[1 + i], "%-4s out of range   ", cell_strategy_name[i]);
+		else
+			sprintf(dsp_buff[1 + i], "%-4s %5luus %2u.%02umV", cell_strategy_name[i],
+					(unsigned long)((bench->scan_us > 99999) ? 99999 : bench->scan_us),
+					bench->worst_sigma_uv / 1000, (bench->worst_sigma_uv % 1000) / 10);
+	}
+	sprintf(dsp_buff[3], "OK to continue      ");
+	update_lcd();
+
+	while (!(PORTA.IN & PIN5_bm));	// DOWN released
+	while (PORTA.IN & PIN2_bm);		// OK pressed
+	while (!(PORTA.IN & PIN2_bm));	// OK released
+	VPORTA_INTFLAGS |= (PIN2_bm | PIN5_bm);
+}
@@ -34,20 +34,59 @@ void test_fsm(void)
 			if (PB_PRESS == BACK)
 				TEST_CURRENT_STATE = SCROLL_TEST_RESULT_MENU_T;
 			else
+			{
+				scroll_cell_page(PB_PRESS);
 				display_voltage_readings(current_test_result);
+			}
 			break;
 		case HEALTH_RATINGS_T:
 			if (PB_PRESS == BACK)
 				TEST_CURRENT_STATE = SCROLL_TEST_RESULT_MENU_T;
+			else if (PB_PRESS == OK && current_test_result.test_mode == 0x02)
+			{
+				// OK on the health ratings of a sweep test opens the fitted internal resistances
+				TEST_CURRENT_STATE = SWEEP_VIEW_T;
+				load_sweep_view();
+			}
 			else
+			{
+				scroll_cell_page(PB_PRESS);
 				display_health_ratings(current_test_result);
+			}
 			break;
 		case TEST_CONDITIONS_T:
 			if (PB_PRESS == BACK)
 				TEST_CURRENT_STATE = SCROLL_TEST_RESULT_MENU_T;
+			else if (PB_PRESS == OK)
+			{
+				// OK on the test conditions opens the waveform captured during the test
+				TEST_CURRENT_STATE = CAPTURE_VIEW_T;
+				capture_view(NONE);
+			}
 			else
 				display_test_conditions(current_test_result);
 			break;
+		case CAPTURE_VIEW_T:
+			if (PB_PRESS == BACK)
+			{
+				TEST_CURRENT_STATE = TEST_CONDITIONS_T;
+				display_test_conditions(current_test_result);
+			}
+			else
+				capture_view(PB_PRESS);
+			break;
+		case SWEEP_VIEW_T:
+			if (PB_PRESS == BACK)
+			{
+				TEST_CURRENT_STATE = HEALTH_RATINGS_T;
+				display_health_ratings(current_test_result);
+			}
+			else
+			{
+				scroll_cell_page(PB_PRESS);
+				load_sweep_view();
+			}
+			break;
 		case DISCARD_RESULTS_T:
 			discard_test_results(PB_PRESS);
 			break;	
@@ -142,6 +181,7 @@ void display_result_data(test_result result_data)
 	{
 		/* LCD line 1: Display voltage measurements */
 		case 1:	
+			cell_page = 0;
 			display_voltage_readings(result_data);		
 			
 			/* Update state variable of fsm */
@@ -153,6 +193,7 @@ void display_result_data(test_result result_data)
 			break;			
 		/* LCD line 2: Display health ratings*/
 		case 2:	
+			cell_page = 0;
 			display_health_ratings(result_data);
 			
 			/* Update state variable of fsm */
@@ -214,6 +255,8 @@ void display_test_conditions(test_result result)
 	sprintf(dsp_buff[3], "Date: 20%u/%u/%u", result.year, result.month, result.day);
 	if (result.test_mode == 0x00)
 		sprintf(dsp_buff[1], "Mode: Manual");
+	else if (result.test_mode == 0x02)
+		sprintf(dsp_buff[1], "Mode: Sweep");
 	else
 		sprintf(dsp_buff[1], "Mode: Automated");
 	update_lcd();
@@ -225,7 +268,7 @@ void display_test_conditions(test_result result)
 // DESCRIPTION
 // Display the loaded and unloaded battery cell voltages from the test. The
 // unloaded voltages are on the left column and the unloaded voltages are 
-//	on the right column.
+//	on the right column. One line per cell starting at cell_page.
 //
 // Inputs  : test_result result_data : test result data struct
 //
@@ -235,10 +278,17 @@ void display_test_conditions(test_result result)
 void display_voltage_readings(test_result result) 
 {
 	clear_lcd();
-	sprintf(dsp_buff[0], "B1: %.3f  B1: %.3f", result.UNLOADED_battery_voltages[0], result.LOADED_battery_voltages[0]);
-	sprintf(dsp_buff[1], "B2: %.3f  B2: %.3f", result.UNLOADED_battery_voltages[1], result.LOADED_battery_voltages[1]);
-	sprintf(dsp_buff[2], "B3: %.3f  B3: %.3f", result.UNLOADED_battery_voltages[2], result.LOADED_battery_voltages[2]);
-	sprintf(dsp_buff[3], "B4: %.3f  B4: %.3f", result.UNLOADED_battery_voltages[3], result.LOADED_battery_voltages[3]);
+	/* Voltages are stored in mV, print as volts with 3 decimal places */
+	for (uint8_t line = 0; line < LCD_LINES && cell_page + line < PACK_CELL_COUNT; line++)
+	{
+		uint8_t i = cell_page + line;
+		
+		/* '?' after the cell number marks a reading that failed its quality check */
+		sprintf(dsp_buff[line], "B%u:%c%u.%03u  B%u:%c%u.%03u", i + 1, (result.quality & QUALITY_UNLOADED_BAD(i)) ? '?' : ' ',
+				result.UNLOADED_battery_voltages[i] / 1000, result.UNLOADED_battery_voltages[i] % 1000, i + 1,
+				(result.quality & QUALITY_LOADED_BAD(i)) ? '?' : ' ',
+				result.LOADED_battery_voltages[i] / 1000, result.LOADED_battery_voltages[i] % 1000);
+	}
 	update_lcd();
 }
 
@@ -247,7 +297,7 @@ void display_voltage_readings(test_result result)
 // Function Name : "decode_health_rating"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// Assigns health ratings to a quad pack based on the loaded voltages. This
+// Assigns health ratings to a pack based on the loaded voltages. This
 //	function calculates the largest threshold from the grading table that the
 //	loaded voltage is greater than or equal to and assigns a health rating. 
 //	An index is then used to load the string for that health rating from a 
@@ -260,28 +310,35 @@ void display_voltage_readings(test_result result)
 //**************************************************************************
 void decode_health_rating(test_result result)
 {
-	uint8_t lut_idx = 0;	// index to lut containing health rating strings
-	float rating_threshold = 2.9;	// minimum threshold for A = 2.9
+	uint8_t lut_idx;	// index to lut containing health rating strings
+	uint16_t rating_threshold_mv;	// minimum threshold for A = 2900mV
 	
-	/* Determine health rating of all 4 battery cells in the quad pack */
-	for (uint8_t i = 0; i < 4; i++)		// outer for loop, 4 battery cells
+	/* Determine health rating of all battery cells in the pack */
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)		// outer for loop, one pass per battery cell
 	{
-		/* Loop until threshold falls below 1.69, F, or loaded voltage no longer meets minimum threshold */
-		while ( (rating_threshold > 1.69) && (rating_threshold >= result.LOADED_battery_voltages[i]) )
+		lut_idx = 0;
+		rating_threshold_mv = 2900;
+		
+		/* Loop until threshold falls below 1690mV, F, or loaded voltage meets the threshold */
+		while ( (rating_threshold_mv > 1690) && (result.LOADED_battery_voltages[i] < rating_threshold_mv) )
 		{
-			/* Compare loaded voltage with threshold to determine health rating */
-			if (result.LOADED_battery_voltages[i] < rating_threshold)
-			{
-				lut_idx++;	// Incrementing lut index lowers rating
-				rating_threshold -= 0.1;	// lower threshold to compare with a lower health rating
-			}
+			lut_idx++;	// Incrementing lut index lowers rating
+			rating_threshold_mv -= 100;	// lower threshold to compare with a lower health rating
 		}	
 		
 		/* Copy health rating strings from look-up table into buffer array */
-		for (uint8_t j = 0; i < 3; j++)	// inner for loop, 3 characters per health rating
+		for (uint8_t j = 0; j < 3; j++)	// inner for loop, 3 characters per health rating
 		{
 			health_rating_characters[(3*i) + j] = health_rating_lut[lut_idx][j];
-		}		
+		}
+		
+		/* A loaded reading that failed its quality check is not graded */
+		if (result.quality & QUALITY_LOADED_BAD(i))
+		{
+			health_rating_characters[3*i] = '?';
+			health_rating_characters[(3*i) + 1] = ' ';
+			health_rating_characters[(3*i) + 2] = ' ';
+		}
 	}
 }
 
@@ -303,15 +360,39 @@ void display_health_ratings(test_result result)
 	/* Write health ratings into character buffer */
 	decode_health_rating(result);
 	
-	/* Update display, array index mapping of char buffer: [0:2]->B1, [3:5]->B2, [6:8]->B3, [9:11]->B4 */
+	/* Update display, array index mapping of char buffer: [3*i : 3*i+2] -> cell i + 1, one line per cell from cell_page */
 	clear_lcd();
-	sprintf(dsp_buff[0], "B1: %c%c%c", health_rating_characters[0],health_rating_characters[1], health_rating_characters[2]);
-	sprintf(dsp_buff[1], "B2: %c%c%c", health_rating_characters[3],health_rating_characters[4], health_rating_characters[5]);
-	sprintf(dsp_buff[2], "B3: %c%c%c", health_rating_characters[6],health_rating_characters[7], health_rating_characters[8]);
-	sprintf(dsp_buff[3], "B4: %c%c%c", health_rating_characters[9],health_rating_characters[10], health_rating_characters[11]);
+	for (uint8_t line = 0; line < LCD_LINES && cell_page + line < PACK_CELL_COUNT; line++)
+	{
+		uint8_t i = cell_page + line;
+		sprintf(dsp_buff[line], "B%u: %c%c%c", i + 1, health_rating_characters[3*i],
+				health_rating_characters[(3*i) + 1], health_rating_characters[(3*i) + 2]);
+	}
 	update_lcd();
 }
 
+//***************************************************************************
+//
+// Function Name : "scroll_cell_page"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Pages through the cells of a pack with more cells than LCD lines. UP
+//	shows the previous LCD_LINES cells, DOWN the next ones. With 4 or fewer
+//	cells the page never moves.
+//
+// Inputs  : PB_INPUT_TYPE pb_type : Pushbutton press identifier
+//
+// Outputs : none
+//
+//**************************************************************************
+void scroll_cell_page(PB_INPUT_TYPE pb_type)
+{
+	if (pb_type == UP && cell_page >= LCD_LINES)
+		cell_page -= LCD_LINES;
+	else if (pb_type == DOWN && cell_page + LCD_LINES < PACK_CELL_COUNT)
+		cell_page += LCD_LINES;
+}
+
 //***************************************************************************
 //
 // Function Name : "display_result_menu"
@@ -436,8 +517,10 @@ void overwrite_previous_results(PB_INPUT_TYPE pb_type)
 // DESCRIPTION
 // Determines whether or not a battery is connected to the load analyzer. 
 //	If the voltage across the battery inputs is less than 100mV, then no
-//	battery is connected. This function must be called before entering the 
-//	TEST_FSM because it sets the initial state to ERROR or TESTING
+//	battery is connected. Otherwise the balance lead is checked tap by tap
+//	and a bad tap fails the test before anything is loaded. This function
+//	must be called before entering the TEST_FSM because it sets the
+//	initial state to ERROR or TESTING
 //
 // Inputs : none
 //
@@ -447,13 +530,19 @@ void overwrite_previous_results(PB_INPUT_TYPE pb_type)
 void is_battery_connected(void)
 {
 	/* Read total battery pack voltage with single-ended measurement */
-	ADC_init(0x00);
-	ADC_channelSEL(B4_ADC_CHANNEL, GND_ADC_CHANNEL);
-	float voltage = ADC_read() * battery_voltage_divider_ratios;
+	int32_t code;
+	ADC_scan_read(adc_scan_pack, 1, &code);
+	pack_voltage_mv = fixed_point_apply(&cell_scale_mv, code);	// also sizes the cell strategy of the test
 			
-	/* If voltage < 0.1V, no battery connection -> move to ERROR state */
-	if (voltage < 0.1)
+	/* If voltage < 100mV, no battery connection -> move to ERROR state */
+	if (pack_voltage_mv < 100)
+	{
+		last_tap_diagnosis.fault = TAP_FAULT_NO_PACK;
 		TEST_CURRENT_STATE = ERROR;	// Move to ERROR state
+	}
+	/* Open, reversed or swapped taps -> move to ERROR state, the error screen names the tap */
+	else if (tap_diagnostics_run(&last_tap_diagnosis) != TAP_FAULT_NONE)
+		TEST_CURRENT_STATE = ERROR;
 	/* Otherwise proceed with test */
 	else
 		TEST_CURRENT_STATE = TESTING;	// Proceed with TEST
@@ -466,7 +555,8 @@ void is_battery_connected(void)
 // Target MCU : AVR128DB48
 // DESCRIPTION
 // Displays an error message indicating that there is no battery connected
-//  to the load analyzer. This function exits the ERROR state once the OK
+//  to the load analyzer, or which tap of the balance lead failed the
+//	pre-test check. This function exits the ERROR state once the OK
 //  or BACK pushbuttons are pressed.
 //
 // Inputs :
@@ -485,6 +575,9 @@ void display_error_message (PB_INPUT_TYPE pb_type)
 		LOCAL_INTERFACE_CURRENT_STATE = MAIN_MENU_STATE;
 		display_main_menu();
 	}
+	/* Display the failed tap if the pack itself is connected */
+	else if (last_tap_diagnosis.fault > TAP_FAULT_NO_PACK)
+		tap_diagnostics_display(&last_tap_diagnosis);
 	/* Display Error message otherwise */
 	else
 	{
@@ -498,78 +591,142 @@ void display_error_message (PB_INPUT_TYPE pb_type)
 }
 //***************************************************************************
 //
-// Function Name : "perform_test"
+// Function Name : "display_load_current"
 // Target MCU : AVR128DB48
 // DESCRIPTION
-// This function performs the loaded and unloaded tests. It reads the 
-//  unloaded voltages and prompts the user to rotate the knob to draw 500A. 
-//	It then reads the loaded battery voltages and beeps until the user turns
-//	the knob back to the unloaded state. This function automatically changes
-//	the current test state to display results regardless of the pushbutton 
-//  press. 
+// Writes the load current to an LCD line in amps with one decimal. The
+//	capture, scheduler and monitor readings have no deadband, so an open
+//	load can read a few mA below zero after the offset is removed; that
+//	is shown as 0.0A.
+//
+// Inputs :
+//		char *line: LCD line buffer
+//		int32_t current_ma: load current in milliamps
+//
+// Outputs : none
+//
+//**************************************************************************
+static void display_load_current(char *line, int32_t current_ma)
+{
+	if (current_ma < 0)
+		current_ma = 0;
+	sprintf(line, "Load Current: %ld.%ldA", (long)(current_ma / 1000), (long)((current_ma % 1000) / 100));
+}
+//***************************************************************************
+//
+// Function Name : "manual_load_test"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Manual loaded test. Prompts the user to rotate the knob to draw 500A.
+//	A pre-trigger capture records current and cells while the load is
+//	ramped. The ADC window comparator flags the 500A crossing, the capture
+//	freezes after the post-trigger frames and starts the loaded snapshot
+//	from the ADC interrupt, the display loop only shows the current. The
+//	load is then held for 1 second.
 //
 // Inputs : none
 //
 // Outputs : none
 //
 //**************************************************************************
-void perform_test(void)
+static void manual_load_test(void)
 {
-	// read voltage of each cell and store in array when unloaded
-	read_UNLOADED_battery_voltages();
-	
-	// Turn ON fan to prevent overheating
-	set_Fan_PWM(75);
-	
-	// Read load current and wait until it hits 500A +/- 20A error
-	load_current_amps = load_current_Read();
+	// Read load current before the capture is armed, the display starts from it
+	load_current_ma = load_current_Read();
 	
 	/* Tell user to rotate knob of carbon pile until beep indicates 500A... */
 	clear_lcd();
 	sprintf(dsp_buff[0], "Rotate Knob until   "); 
 	sprintf(dsp_buff[1], "beeping sound is    ");
 	sprintf(dsp_buff[2], "heard...            ");
-	sprintf(dsp_buff[3], "Load Current: %.1fA ", load_current_amps);
+	display_load_current(dsp_buff[3], load_current_ma);
 	update_lcd();
 	
-	while (load_current_amps < 500)	// infinite loop until current reaches 500A
+	/* Capture triggers at 500A and starts the loaded snapshot scan once it is frozen */
+	capture_arm(load_current_code(500000), adc_scan_snapshot, LOADED_SNAPSHOT_LENGTH);
+
+	while (!capture_isDone())	// infinite loop until current reaches 500A
 	{		
-		/* Update current reading on display if changes by more than 2% */ 
-		load_current_amps = load_current_Read();
+		/* Update current reading on display from the newest captured sample */ 
+		load_current_ma = load_current_from_code(capture_latest_code(0));
 		
 		_delay_ms(50);	// delay to prevent LCD to updating too fast
 		clear_lcd();
 		sprintf(dsp_buff[0], "Rotate Knob until   "); 
 		sprintf(dsp_buff[1], "beeping sound is    ");
 		sprintf(dsp_buff[2], "heard...            ");
-		sprintf(dsp_buff[3], "Load Current: %.1fA ", load_current_amps);
+		display_load_current(dsp_buff[3], load_current_ma);
 		update_lcd();
 	}
 		
-	// read voltage of each cell and store in array once load current reaches 500A
-	read_LOADED_battery_voltages();
-	_delay_ms(1000);
+	// store voltage of each cell from the snapshot taken after the capture froze at 500A
+	collect_LOADED_battery_voltages();
+	load_current_ma = last_loaded_snapshot.current_ma;
 
+	/* Hold the load for 1 second, current, cell sag and temperature are sampled at their own rates */
+	scheduler_start();
+	for (uint8_t i = 0; i < 10; i++)
+	{
+		_delay_ms(100);
+		uint16_t min_cell_mv = 0xFFFF;
+		for (uint8_t j = 0; j < PACK_CELL_COUNT; j++)
+		{
+			uint16_t cell_mv = (uint16_t)fixed_point_apply(&cell_scale_mv, scheduler_read(adc_scan_cells[j]));
+			if (cell_mv < min_cell_mv)
+				min_cell_mv = cell_mv;
+		}
+		load_current_ma = load_current_from_code(scheduler_read(ADC_CH_LOAD_CURRENT));
+		adc_utilization_permille = scheduler_utilization();
+
+		clear_lcd();
+		sprintf(dsp_buff[0], "Holding load...     ");
+		display_load_current(dsp_buff[1], load_current_ma);
+		sprintf(dsp_buff[2], "Min Cell: %u.%03uV", min_cell_mv / 1000, min_cell_mv % 1000);
+		sprintf(dsp_buff[3], "ADC Load: %u.%u%%", adc_utilization_permille / 10, adc_utilization_permille % 10);
+		update_lcd();
+	}
+	int16_t temperature = temperature_from_code(scheduler_read(ADC_CH_TEMPERATURE));
+	current_test_result.ampient_temp = (temperature < 0) ? 0 : (uint8_t)temperature;
+	scheduler_stop();
+	load_current_ma = last_loaded_snapshot.current_ma;
+}
+//***************************************************************************
+//
+// Function Name : "wait_for_load_off"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Beeps until the window comparator sees the user turn the knob back
+//	below 200A.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void wait_for_load_off(void)
+{
 	/* Tell user to turn off carbon pile load... */
 	clear_lcd();
 	sprintf(dsp_buff[0], "Test complete...    ");
 	sprintf(dsp_buff[1], "Rotate Knob until   ");
 	sprintf(dsp_buff[2], "beeping stops...    ");	
-	sprintf(dsp_buff[3], "Load Current: %.1fA ", load_current_amps);
+	display_load_current(dsp_buff[3], load_current_ma);
 	update_lcd();
 
-	/* Make buzzer beep until current is below 50A */	
-	while (load_current_amps > 200)
+	/* Make buzzer beep until the window comparator sees the current drop below 200A */	
+	ADC_monitor_start(ADC_CH_LOAD_CURRENT, ADC_WINCM_BELOW_gc, load_current_code(200000), NULL, 0);
+
+	while (!ADC_monitor_isLatched())
 	{	
-		/* Update current reading on display if changes by more than 2% */
-		load_current_amps = load_current_Read();
+		/* Update current reading on display from the monitored channel */
+		load_current_ma = load_current_from_code(ADC_monitor_read());
 
 		_delay_ms(50);
 		clear_lcd();
 		sprintf(dsp_buff[0], "Test complete...    ");
 		sprintf(dsp_buff[1], "Rotate Knob until   ");
 		sprintf(dsp_buff[2], "beeping stops...    ");
-		sprintf(dsp_buff[3], "Load Current: %.1fA ", load_current_amps);
+		display_load_current(dsp_buff[3], load_current_ma);
 		update_lcd();		
 		
 		buzzer_ON();		
@@ -577,6 +734,110 @@ void perform_test(void)
 		buzzer_OFF();
 		_delay_ms(1000);		// wait 1 second
 	}
+}
+//***************************************************************************
+//
+// Function Name : "automated_load_test"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Automated loaded test at current_setting. The stepper brings the load
+//	to the setting, load_hold() keeps it there for LOAD_HOLD_MS and the
+//	mean cell voltages and current of the end of the hold are stored, so
+//	every pack is measured at the same truly constant current whoever runs
+//	the test. A sweep test gets there through the steps of load_sweep_run()
+//	instead and fits the internal resistance of every cell on the way. The
+//	knob then opens the load, if it cannot the user is asked to turn it
+//	off by hand.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+static void automated_load_test(void)
+{
+	int32_t target_ma = (int32_t)current_setting * 1000;
+	uint16_t bad = 0;
+
+	clear_lcd();
+	sprintf(dsp_buff[0], "Automated test...   ");
+	update_lcd();
+	if (testing_mode == 0x02)
+	{
+		if (!load_sweep_run(target_ma))
+			bad = QUALITY_LOADED_MASK;	// the last step moved while the cells were measured
+	}
+	else
+	{
+		sprintf(dsp_buff[1], "Setting load %3uA   ", current_setting);
+		update_lcd();
+		set_load_current(target_ma);
+
+		sprintf(dsp_buff[1], "Holding load %3uA   ", current_setting);
+		update_lcd();
+		if (!load_hold(target_ma, LOAD_HOLD_MS))
+			bad = QUALITY_LOADED_MASK;	// the current moved while the cells were measured
+	}
+
+	/* Store mean cell voltages and the mean current they were measured at */
+	for (uint8_t i = 0; i < PACK_CELL_COUNT; i++)
+	{
+		current_test_result.LOADED_battery_voltages[i] = (uint16_t)measurement_stats_mean(&loaded_cell_stats[i]);
+		if (measurement_stats_quality(&loaded_cell_stats[i], LOADED_MAX_STDDEV_MV, CELL_MIN_MV, CELL_MAX_MV) != MEASUREMENT_OK)
+			bad |= QUALITY_LOADED_BAD(i);
+	}
+	load_current_ma = measurement_stats_mean(&loaded_current_stats);
+	current_test_result.max_load_current = (uint16_t)(load_current_ma / 1000);
+	current_test_result.quality = (current_test_result.quality & QUALITY_UNLOADED_MASK) | bad;
+	current_test_result.ampient_temp = (last_load_hold.temperature_c < 0) ? 0 : (uint8_t)last_load_hold.temperature_c;
+
+	sprintf(dsp_buff[1], "Opening load...     ");
+	update_lcd();
+	if (!open_circuit_load())
+		wait_for_load_off();
+}
+//***************************************************************************
+//
+// Function Name : "perform_test"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// This function performs the loaded and unloaded tests. It reads the 
+//  unloaded voltages, then runs the loaded test of the testing mode:
+//	manual_load_test() with the user turning the knob, followed by
+//	wait_for_load_off(), or automated_load_test() for the automated and
+//	sweep modes. Only the manual test records a capture, the one of an
+//	earlier test is dropped first so the conditions screen never shows it.
+//	This function automatically changes the current test state to display
+//	results regardless of the pushbutton press.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void perform_test(void)
+{
+	capture_abort();	// a capture of an earlier test does not belong to this one
+
+	// read voltage of each cell and store in array when unloaded, with the fastest strategy precise enough for this pack
+	tap_solver_select(pack_voltage_mv);
+	read_UNLOADED_battery_voltages();
+	tap_solver_release();
+	
+	// Zero the current amplifier while the carbon pile is still open, a failed zero keeps the last offsets
+	opamp_auto_zero();
+	
+	// Turn ON fan to prevent overheating
+	set_Fan_PWM(75);
+	
+	current_test_result.test_mode = testing_mode;
+	if (testing_mode == 0x01 || testing_mode == 0x02)
+		automated_load_test();
+	else
+	{
+		manual_load_test();
+		wait_for_load_off();
+	}
 		
 	set_Fan_PWM(0);	// Turn fan OFF
 
@@ -0,0 +1,47 @@
+#include "main.h"
+
+//***************************************************************************
+//
+// Function Name : "timestamp_init"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Configures TCB1 as a free-running 16-bit timestamp counter clocked from
+// CLK_PER/2. At 4MHz one tick is 0.5us and the counter wraps every
+// 32.7ms, which is enough to time-stamp every conversion of a scan.
+// Differences between timestamps must be taken with uint16_t arithmetic
+// so the wrap is handled.
+//
+// Inputs : none
+//
+// Outputs : none
+//
+//**************************************************************************
+void timestamp_init(void)
+{
+	TCB1.CCMP = 0xFFFF;						// Count through the full 16-bit range
+	TCB1.CTRLB = TCB_CNTMODE_INT_gc;		// Periodic interrupt mode, interrupt left disabled
+	TCB1.CTRLA = (TCB_CLKSEL_DIV2_gc | TCB_ENABLE_bm);	// CLK_PER/2, Enable
+}
+//***************************************************************************
+//
+// Function Name : "timestamp_now"
+// Target MCU : AVR128DB48
+// DESCRIPTION
+// Reads the timestamp counter. The 16-bit read goes through the shared
+// TEMP register, so it is done with interrupts masked in case an ISR
+// reads the counter at the same time.
+//
+// Inputs : none
+//
+// Outputs :
+//		uint16_t ticks: current timestamp in TIMESTAMP_TICKS_PER_US units
+//
+//**************************************************************************
+uint16_t timestamp_now(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t ticks = TCB1.CNT;
+	SREG = sreg;
+	return ticks;
+}
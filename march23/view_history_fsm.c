@@ -27,13 +27,19 @@ void view_history_fsm(void)
 			if (PB_PRESS == BACK)
 				VIEW_HISTORY_CURRENT_STATE = SCROLL_PREVIOUS_RESULTS;
 			else
+			{
+				scroll_cell_page(PB_PRESS);
 				display_voltage_readings(current_test_result);
+			}
 			break;
 		case HEALTH_RATINGS_H:
 			if (PB_PRESS == BACK)
 				VIEW_HISTORY_CURRENT_STATE = SCROLL_PREVIOUS_RESULTS;
 			else
+			{
+				scroll_cell_page(PB_PRESS);
 				display_health_ratings(current_test_result);
+			}
 			break;
 		case TEST_CONDITIONS_H:
 			if (PB_PRESS == BACK)